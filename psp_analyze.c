@@ -0,0 +1,756 @@
+/*
+ * psp_analyze : Offline analyzer for Sony PSP serial remote traces
+ * version 1.00
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *
+ * Notes:
+ *
+ * Reads capture files written by psp_remote -c, as well as raw dumps of
+ * what the PSP sends (e.g. "cat /dev/ttyS0 > dump"), which have no
+ * timestamps and are taken as inbound only.
+ *
+ * Each file is memory mapped and its records decoded where they are, in
+ * order, by one decoder per direction. Between frames, only delimiters
+ * matter: they are located with a vectorized scan instead of going through
+ * every byte the way the protocol engine does. Frames are matched with
+ * their ACKs as they go by, and what is behind is dropped from memory, so
+ * that the size of a file doesn't matter. Files are spread over as many
+ * threads as there are cores, and the results merged once they are all
+ * done.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "pspremote.h"
+
+#define u8  unsigned char            // The usual supsect
+#define u32 unsigned int
+
+#define MAX_THREADS  64
+#define MAX_EXAMPLES 5               // Violations listed per type
+#define HIST_BUCKETS 24              // Latency histogram, log2(us)
+#define RETIRE       (16<<20)        // Mapped bytes dropped at a time, once decoded
+
+// Protocol violations
+#define V_CHECKSUM   0
+#define V_LENGTH     1
+#define V_TRUNCATED  2
+#define V_UNKNOWN    3
+#define V_STRAY      4
+#define V_ACK_NONE   5
+#define V_ACK_PHASE  6
+#define V_NO_ACK     7
+#define V_NB         8
+
+const char* v_names[V_NB] = {
+   "bad checksum",
+   "bad length / no FRAME_STOP",
+   "truncated frame",
+   "unknown command",
+   "stray bytes",
+   "ACK with no frame pending",
+   "ACK with wrong phase",
+   "frame never acknowledged",
+};
+
+// Latency measurements
+#define L_OUT        0               // Our frame -> PSP's ACK
+#define L_IN         1               // PSP's frame -> our ACK
+#define L_NB         2
+
+const char* l_names[L_NB] = {
+   "Our frame -> PSP ACK",
+   "PSP frame -> our ACK",
+};
+
+// Delimiters we count, by direction
+const u8 delims[] = { PSP_FRAME_RTS, PSP_FRAME_CTS, PSP_FRAME_ACK0, PSP_FRAME_ACK1 };
+const char* delim_names[] = { "FRAME_RTS", "FRAME_CTS", "FRAME_ACK0", "FRAME_ACK1" };
+#define NB_DELIMS    4
+
+// Where a byte of a direction's stream came from
+typedef struct {
+   long   num;                       // Record number, for ordering
+   long   offset;                    // Offset in the file
+   double t;
+} where;
+
+// A protocol event, from either direction
+typedef struct {
+   where  at;
+   u8     dir;
+   u8     type;                      // Delimiter, or FRAME_START for a good frame
+   u8     command;
+} event;
+
+typedef struct {
+   long offset;
+   int  dir;
+} example;
+
+// Everything we learn from a file
+typedef struct {
+   const char*   name;
+   char          err[128];
+   int           raw;
+   long          bytes;
+   long          records;
+   double        span;
+   unsigned long frames[2][128];     // Good frames by direction and command>>1
+   unsigned long ndelims[2][NB_DELIMS];
+   unsigned long viol[V_NB];
+   example       ex[V_NB][MAX_EXAMPLES];
+   u32*          lat[L_NB];          // Latencies (us)
+   long          nlat[L_NB];
+   long          maxlat[L_NB];
+} result;
+
+// Decoder states
+#define D_IDLE       0               // Between frames
+#define D_FRAME      1               // Inside a frame
+#define D_SKIP       2               // Resyncing on the next FRAME_START
+
+// One direction of a file, decoded as its records go by
+typedef struct {
+   int    state;
+   long   gap;                       // Offset of stray bytes not reported yet (-1 = none)
+   where  start;                     // FRAME_START of the current frame
+   int    len;                       // Bytes seen since FRAME_START
+   int    size;                      // Expected data size (-1 = unknown command)
+   // What came after FRAME_START, to resync from if the frame is bad. One
+   // more than the longest frame, so that one we resync in is too long too
+   u8     buf[PSP_MAX_BYTES+4];
+   where  at[PSP_MAX_BYTES+4];
+} decoder;
+
+// A file being analyzed
+typedef struct {
+   result*  r;
+   int      check;                   // Match frames with ACKs (not for raw dumps)
+   decoder  dc[2];
+   event    pending[2];              // Frame from each direction waiting for an ACK
+   int      waiting[2];
+} session;
+
+int nb_files;
+result* results;
+int next_file = 0;
+
+
+/*
+ *
+ * Growable arrays. This is an offline tool: the heap is fair game
+ *
+ */
+void* grow(void* p, long* max, long n, int size)
+{
+     if (n < *max)
+         return p;
+     *max = (*max)?(*max)*2:4096;
+     p = realloc(p, (*max) * size);
+     if (p == NULL)
+     {
+         fprintf(stderr, "Out of memory\n");
+         exit(1);
+     }
+     return p;
+}
+
+
+/*
+ *
+ * next_delim(): position of the next frame delimiter in a buffer, len if none
+ *
+ */
+static inline int is_delim(u8 b)
+{
+     return (b == PSP_FRAME_RTS) || (b == PSP_FRAME_CTS) || (b == PSP_FRAME_ACK0) ||
+            (b == PSP_FRAME_ACK1) || (b == PSP_FRAME_START) || (b == PSP_FRAME_STOP);
+}
+
+long next_delim(const u8* p, long i, long len)
+{
+#ifdef __SSE2__
+const __m128i f0 = _mm_set1_epi8((char)PSP_FRAME_RTS);
+const __m128i f8 = _mm_set1_epi8((char)PSP_FRAME_CTS);
+const __m128i fa = _mm_set1_epi8((char)PSP_FRAME_ACK0);
+const __m128i fb = _mm_set1_epi8((char)PSP_FRAME_ACK1);
+const __m128i fd = _mm_set1_epi8((char)PSP_FRAME_START);
+const __m128i fe = _mm_set1_epi8((char)PSP_FRAME_STOP);
+__m128i v, m;
+int mask;
+
+     for (; i+16 <= len; i+=16)
+     {
+         v = _mm_loadu_si128((const __m128i*)(p+i));
+         // Quick reject: all the delimiters are >= 0xf0
+         if (!_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, f0), v)))
+             continue;
+         m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, f0), _mm_cmpeq_epi8(v, f8)),
+                          _mm_or_si128(_mm_cmpeq_epi8(v, fa), _mm_cmpeq_epi8(v, fb)));
+         m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, fd), _mm_cmpeq_epi8(v, fe)));
+         mask = _mm_movemask_epi8(m);
+         if (mask)
+             return i + __builtin_ctz(mask);
+     }
+#endif
+     for (; i<len; i++)
+         if (is_delim(p[i]))
+             return i;
+     return len;
+}
+
+
+/*
+ *
+ * Violations and latencies
+ *
+ */
+void violation(result* r, int v, int dir, long offset)
+{
+     if (r->viol[v] < MAX_EXAMPLES)
+     {
+         r->ex[v][r->viol[v]].offset = offset;
+         r->ex[v][r->viol[v]].dir = dir;
+     }
+     r->viol[v]++;
+}
+
+void latency(result* r, int l, double dt)
+{
+     r->lat[l] = grow(r->lat[l], &r->maxlat[l], r->nlat[l], sizeof(u32));
+     r->lat[l][r->nlat[l]++] = (dt < 0)?0:(u32)(dt*1000000.0);
+}
+
+
+/*
+ *
+ * emit(): match a protocol event with what the other side is waiting for.
+ * Events come in the order of the records, so both directions are checked
+ * as the file goes by
+ *
+ */
+void emit(session* ss, int dir, u8 type, u8 command, const where* at)
+{
+result* r = ss->r;
+
+     if (!ss->check)
+         return;
+
+     switch (type)
+     {
+         case PSP_FRAME_START:
+             // A new frame while the previous one is still unanswered
+             if (ss->waiting[dir])
+                 violation(r, V_NO_ACK, dir, ss->pending[dir].at.offset);
+             ss->pending[dir].at = *at;
+             ss->pending[dir].dir = dir;
+             ss->pending[dir].type = type;
+             ss->pending[dir].command = command;
+             ss->waiting[dir] = 1;
+             break;
+         case PSP_FRAME_ACK0:
+         case PSP_FRAME_ACK1:
+             // Acknowledges a frame from the other side
+             if (!ss->waiting[!dir])
+                 violation(r, V_ACK_NONE, dir, at->offset);
+             else if ((type & 0x01) != (ss->pending[!dir].command & 0x01))
+                 violation(r, V_ACK_PHASE, dir, at->offset);
+             else
+             {
+                 latency(r, (dir == PSP_DIR_IN)?L_OUT:L_IN, at->t - ss->pending[!dir].at.t);
+                 ss->waiting[!dir] = 0;
+             }
+             break;
+     }
+}
+
+
+/*
+ *
+ * feed(): one byte of a direction's stream, with the same rules as the
+ * protocol engine's read_frame()
+ *
+ */
+void feed(session* ss, int dir, u8 b, const where* at);
+
+// Drop a bad frame and resync on the next FRAME_START, which can be in
+// what we took for its data. b is the byte that gave it away (at = NULL
+// at the end of the stream), to be fed again if it could not be kept
+static void drop_frame(session* ss, int dir, int v, u8 b, const where* at)
+{
+decoder* dc = &ss->dc[dir];
+u8 buf[sizeof(dc->buf)];
+where w[sizeof(dc->buf)];
+int n, lost, i;
+
+     violation(ss->r, v, dir, dc->start.offset);
+     n = (dc->len < sizeof(buf))?dc->len:sizeof(buf);
+     lost = dc->len - n;
+     memcpy(buf, dc->buf, n);
+     memcpy(w, dc->at, n*sizeof(where));
+     dc->state = D_SKIP;
+     for (i=0; i<n; i++)
+         feed(ss, dir, buf[i], &w[i]);
+     if (lost == 0)
+         return;
+
+     // Only a frame too long loses bytes, and there was no FRAME_START in
+     // them: a frame we resynced in is just as many bytes longer
+     if (at)
+         lost--;
+     if (dc->state == D_FRAME)
+         dc->len += lost;
+     if (at)
+         feed(ss, dir, b, at);
+}
+
+void feed(session* ss, int dir, u8 b, const where* at)
+{
+decoder* dc = &ss->dc[dir];
+result* r = ss->r;
+u8 checksum;
+int i, k, len;
+
+     switch (dc->state)
+     {
+         case D_SKIP:
+             if (b != PSP_FRAME_START)
+                 return;
+             dc->state = D_IDLE;
+             // Fall through
+         case D_IDLE:
+             if (!is_delim(b))
+             {
+                 if (dc->gap < 0)
+                     dc->gap = at->offset;
+                 return;
+             }
+             if (dc->gap >= 0)
+                 violation(r, V_STRAY, dir, dc->gap);
+             dc->gap = -1;
+             if (b == PSP_FRAME_STOP)
+                 violation(r, V_STRAY, dir, at->offset);
+             else if (b == PSP_FRAME_START)
+             {
+                 dc->state = D_FRAME;
+                 dc->start = *at;
+                 dc->len = 0;
+             }
+             else
+             {
+                 for (k=0; k<NB_DELIMS; k++)
+                     if (b == delims[k])
+                         r->ndelims[dir][k]++;
+                 emit(ss, dir, b, 0, at);
+             }
+             return;
+     }
+
+     // Inside a frame: keep what we can resync from
+     if (dc->len < sizeof(dc->buf))
+     {
+         dc->buf[dc->len] = b;
+         dc->at[dc->len] = *at;
+     }
+     dc->len++;
+     if (dc->len == 1)
+     {
+         dc->size = psp_cmd_size(b);
+         return;
+     }
+
+     if (dc->size >= 0)
+     {   // We know where the frame must end
+         len = dc->size+2;
+         if (dc->len < len+1)
+             return;
+         if (b != PSP_FRAME_STOP)
+         {
+             drop_frame(ss, dir, V_LENGTH, b, at);
+             return;
+         }
+     }
+     else
+     {   // Unknown command => FRAME_STOP ends it
+         if (b == PSP_FRAME_START)
+         {
+             drop_frame(ss, dir, V_TRUNCATED, b, at);
+             return;
+         }
+         if (b != PSP_FRAME_STOP)
+             return;
+         len = dc->len-1;
+         if ((len < 2) || (len > PSP_MAX_BYTES+2))
+         {
+             drop_frame(ss, dir, V_LENGTH, b, at);
+             return;
+         }
+     }
+
+     // Verify checksum: command ^ data ^ checksum must be 0
+     checksum = 0;
+     for (i=0; i<len; i++)
+         checksum ^= dc->buf[i];
+     if (checksum != 0)
+     {
+         drop_frame(ss, dir, V_CHECKSUM, b, at);
+         return;
+     }
+     if (dc->size < 0)
+         violation(r, V_UNKNOWN, dir, dc->start.offset);
+     r->frames[dir][dc->buf[0]>>1]++;
+     dc->state = D_IDLE;
+     emit(ss, dir, PSP_FRAME_START, dc->buf[0], &dc->start);
+}
+
+
+/*
+ *
+ * feed_record(): the data of a record. Only delimiters matter between
+ * frames, so the rest is skipped over with a vectorized scan
+ *
+ */
+void feed_record(session* ss, int dir, const u8* p, long len, where* at)
+{
+decoder* dc = &ss->dc[dir];
+const u8* q;
+long base = at->offset;
+long i = 0, j;
+
+     while (i < len)
+     {
+         if (dc->state == D_IDLE)
+         {
+             j = next_delim(p, i, len);
+             if ((j > i) && (dc->gap < 0))
+                 dc->gap = base + i;
+             if ((i = j) == len)
+                 break;
+         }
+         else if (dc->state == D_SKIP)
+         {
+             q = memchr(p+i, PSP_FRAME_START, len-i);
+             if (q == NULL)
+                 break;
+             i = q - p;
+         }
+         at->offset = base + i;
+         feed(ss, dir, p[i++], at);
+     }
+}
+
+
+/*
+ *
+ * finish(): the end of a direction's stream
+ *
+ */
+void finish(session* ss, int dir)
+{
+decoder* dc = &ss->dc[dir];
+
+     while (dc->state == D_FRAME)
+         drop_frame(ss, dir, V_TRUNCATED, 0, NULL);
+     if ((dc->state == D_IDLE) && (dc->gap >= 0))
+         violation(ss->r, V_STRAY, dir, dc->gap);
+}
+
+
+/*
+ *
+ * analyze(): everything about one file
+ *
+ */
+void analyze(result* r)
+{
+session ss;
+psp_cap_rec rec;
+where at;
+struct stat st;
+const u8* map;
+long pos, done = 0;
+int fd, dir;
+
+     fd = open(r->name, O_RDONLY);
+     if ((fd < 0) || (fstat(fd, &st) < 0))
+     {
+         sprintf(r->err, "cannot open");
+         if (fd >= 0)
+             close(fd);
+         return;
+     }
+     r->bytes = st.st_size;
+     if (st.st_size == 0)
+     {
+         close(fd);
+         return;
+     }
+     map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+     close(fd);
+     if (map == MAP_FAILED)
+     {
+         sprintf(r->err, "cannot map");
+         return;
+     }
+     madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+
+     memset(&ss, 0, sizeof(ss));
+     ss.r = r;
+     for (dir=0; dir<2; dir++)
+     {
+         ss.dc[dir].state = D_IDLE;
+         ss.dc[dir].gap = -1;
+     }
+
+     if ((st.st_size >= PSP_CAP_MAGIC_SIZE) && (memcmp(map, PSP_CAP_MAGIC, PSP_CAP_MAGIC_SIZE) == 0))
+     {   // Capture: decode the records where they are, in order
+         ss.check = 1;
+         for (pos = PSP_CAP_MAGIC_SIZE; pos + sizeof(rec) <= st.st_size; pos += sizeof(rec) + rec.len)
+         {
+             memcpy(&rec, map+pos, sizeof(rec));
+             if ((rec.dir > PSP_DIR_OUT) || (pos + sizeof(rec) + rec.len > st.st_size))
+             {
+                 sprintf(r->err, "corrupted record at offset %ld", pos);
+                 break;
+             }
+             at.num = r->records++;
+             at.offset = pos + sizeof(rec);
+             at.t = rec.sec + rec.usec/1000000.0;
+             if (at.t > r->span)
+                 r->span = at.t;
+             feed_record(&ss, rec.dir, map+pos+sizeof(rec), rec.len, &at);
+
+             // Nothing points back into what is behind us => let it go
+             if (pos - done >= RETIRE)
+             {
+                 madvise((void*)(map+done), RETIRE, MADV_DONTNEED);
+                 done += RETIRE;
+             }
+         }
+     }
+     else
+     {   // Raw dump of what the PSP sent
+         r->raw = 1;
+         at.num = 0;
+         at.offset = 0;
+         at.t = 0;
+         feed_record(&ss, PSP_DIR_IN, map, st.st_size, &at);
+     }
+
+     for (dir=0; dir<2; dir++)
+         finish(&ss, dir);
+     munmap((void*)map, st.st_size);
+}
+
+
+void* worker(void* arg)
+{
+int i;
+     while ((i = __sync_fetch_and_add(&next_file, 1)) < nb_files)
+         analyze(&results[i]);
+     return NULL;
+}
+
+
+/*
+ *
+ * Report
+ *
+ */
+int cmp_u32(const void* a, const void* b)
+{
+     return (*(u32*)a > *(u32*)b) - (*(u32*)a < *(u32*)b);
+}
+
+void print_latency(int l, u32* lat, long n)
+{
+unsigned long hist[HIST_BUCKETS];
+unsigned long top = 0;
+int i, b;
+
+     printf("\n%s: ", l_names[l]);
+     if (n == 0)
+     {
+         printf("no samples\n");
+         return;
+     }
+     qsort(lat, n, sizeof(u32), cmp_u32);
+     printf("%ld samples (ms)\n", n);
+     printf("    min %.3f  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+            lat[0]/1000.0, lat[n/2]/1000.0, lat[n*9/10]/1000.0, lat[n*99/100]/1000.0, lat[n-1]/1000.0);
+
+     memset(hist, 0, sizeof(hist));
+     for (i=0; i<n; i++)
+     {
+         b = (lat[i] == 0)?0:(32 - __builtin_clz(lat[i]));
+         hist[(b < HIST_BUCKETS)?b:HIST_BUCKETS-1]++;
+     }
+     for (b=0; b<HIST_BUCKETS; b++)
+         if (hist[b] > top)
+             top = hist[b];
+     for (b=0; b<HIST_BUCKETS; b++)
+     {
+         if (hist[b] == 0)
+             continue;
+         printf("    < %9.3f ms %10lu ", (1UL<<b)/1000.0, hist[b]);
+         for (i=0; i<(int)(hist[b]*40/top); i++)
+             putchar('#');
+         putchar('\n');
+     }
+}
+
+
+int main (int argc, char *argv[])
+{
+pthread_t threads[MAX_THREADS];
+struct timeval t0, t1;
+int opt_threads = 0;
+int opt_error = 0;
+long bytes = 0, records = 0, n;
+double span = 0, elapsed;
+unsigned long frames[2][128];
+unsigned long ndelims[2][NB_DELIMS];
+unsigned long viol[V_NB];
+u32* lat[L_NB];
+long nlat[L_NB];
+int failed = 0;
+int i, j, k, l, shown;
+
+     while ((i = getopt (argc, argv, "hj:")) != -1)
+     switch (i)
+     {
+		case 'j':		// Number of threads
+			opt_threads = atoi(optarg);
+			break;
+		case 'h':
+		default:		// Unknown option
+			opt_error++;
+			break;
+     }
+
+     if ((optind >= argc) || (opt_error))
+     {
+         printf ("usage: psp_analyze [-j threads] file [file...]\n");
+         printf ("Files are captures from psp_remote -c, or raw dumps of what the PSP sent.\n");
+         printf ("Options:\n");
+         printf ("        -j threads : number of files analyzed in parallel (default: one per core)\n\n");
+         exit (1);
+     }
+
+     nb_files = argc-optind;
+     results = calloc(nb_files, sizeof(result));
+     for (i=0; i<nb_files; i++)
+         results[i].name = argv[optind+i];
+
+     if (opt_threads <= 0)
+         opt_threads = sysconf(_SC_NPROCESSORS_ONLN);
+     if (opt_threads > nb_files)
+         opt_threads = nb_files;
+     if (opt_threads > MAX_THREADS)
+         opt_threads = MAX_THREADS;
+     if (opt_threads < 1)
+         opt_threads = 1;
+
+     gettimeofday(&t0, NULL);
+     for (i=0; i<opt_threads; i++)
+         pthread_create(&threads[i], NULL, worker, NULL);
+     for (i=0; i<opt_threads; i++)
+         pthread_join(threads[i], NULL);
+     gettimeofday(&t1, NULL);
+     elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec)/1000000.0;
+
+     // Merge
+     memset(frames, 0, sizeof(frames));
+     memset(ndelims, 0, sizeof(ndelims));
+     memset(viol, 0, sizeof(viol));
+     memset(nlat, 0, sizeof(nlat));
+     for (i=0; i<nb_files; i++)
+     {
+         if (results[i].err[0])
+         {
+             fprintf(stderr, "%s: %s\n", results[i].name, results[i].err);
+             failed++;
+         }
+         bytes += results[i].bytes;
+         records += results[i].records;
+         span += results[i].span;
+         for (j=0; j<2; j++)
+         {
+             for (k=0; k<128; k++)
+                 frames[j][k] += results[i].frames[j][k];
+             for (k=0; k<NB_DELIMS; k++)
+                 ndelims[j][k] += results[i].ndelims[j][k];
+         }
+         for (k=0; k<V_NB; k++)
+             viol[k] += results[i].viol[k];
+         for (l=0; l<L_NB; l++)
+             nlat[l] += results[i].nlat[l];
+     }
+     for (l=0; l<L_NB; l++)
+     {
+         lat[l] = malloc((nlat[l]+1) * sizeof(u32));
+         for (n=0, i=0; i<nb_files; i++)
+             if (results[i].nlat[l])
+             {
+                 memcpy(lat[l]+n, results[i].lat[l], results[i].nlat[l] * sizeof(u32));
+                 n += results[i].nlat[l];
+             }
+     }
+
+     printf("Files: %d, %ld bytes, %ld records, %.3f s of traffic\n", nb_files, bytes, records, span);
+     printf("Analyzed in %.3f s (%.1f MB/s) with %d thread(s)\n",
+            elapsed, (elapsed > 0)?bytes/elapsed/1000000.0:0, opt_threads);
+
+     printf("\n%-16s %12s %12s\n", "", "from PSP", "to PSP");
+     for (k=0; k<NB_DELIMS; k++)
+         printf("%-16s %12lu %12lu\n", delim_names[k], ndelims[PSP_DIR_IN][k], ndelims[PSP_DIR_OUT][k]);
+     for (k=0; k<128; k++)
+     {
+         if (frames[PSP_DIR_IN][k] + frames[PSP_DIR_OUT][k] == 0)
+             continue;
+         if (strcmp(psp_cmd_name(k<<1), "UNKNOWN"))
+             printf("%-16s %12lu %12lu\n", psp_cmd_name(k<<1), frames[PSP_DIR_IN][k], frames[PSP_DIR_OUT][k]);
+         else
+             printf("CMD %02X           %12lu %12lu\n", k<<1, frames[PSP_DIR_IN][k], frames[PSP_DIR_OUT][k]);
+     }
+
+     for (l=0; l<L_NB; l++)
+         print_latency(l, lat[l], nlat[l]);
+
+     printf("\nProtocol violations:\n");
+     for (k=0; k<V_NB; k++)
+     {
+         printf("    %-28s %10lu\n", v_names[k], viol[k]);
+         for (shown=0, i=0; (i<nb_files) && (shown<MAX_EXAMPLES); i++)
+             for (j=0; (j<results[i].viol[k]) && (j<MAX_EXAMPLES) && (shown<MAX_EXAMPLES); j++, shown++)
+                 printf("        %s: %s at offset %ld\n", results[i].name,
+                        (results[i].ex[k][j].dir == PSP_DIR_IN)?"from PSP":"to PSP",
+                        results[i].ex[k][j].offset);
+     }
+
+     // Some files could not be analyzed (in full) => let scripts know
+     exit((failed)?1:0);
+}
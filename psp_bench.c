@@ -0,0 +1,249 @@
+/*
+ * psp_bench : Protocol engine benchmark for Sony PSP serial remote
+ * version 1.00
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *
+ * Notes:
+ *
+ * Replays captures from psp_remote -c through the protocol engine, as
+ * fast as it goes: what the PSP sent is fed back through io.recv(), on
+ * the recorded clock, and the keys we sent are queued again, so that the
+ * parser and the command path both run the way they did in the session.
+ * Used as the training run of "make pgo" and to measure what it brings.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include "pspremote.h"
+
+#define u8  unsigned char            // The usual supsect
+
+#define DEFAULT_LOOPS 100            // Times the corpus is replayed
+#define MAX_STEPS     64             // Steps allowed to take in one inbound record
+
+// A capture, loaded in memory
+typedef struct {
+   const char* name;
+   u8*         data;
+   long        len;
+} capture;
+
+// What the engine sees of the replayed line
+typedef struct {
+   const u8* in;                     // Inbound record being delivered
+   int       in_len;
+   int       in_pos;
+   double    now;                    // Time of the current record
+   long      sent;                   // Bytes the engine wrote
+} replay;
+
+
+/*
+ *
+ * Replayed I/O
+ *
+ */
+static double rp_now(void* user)
+{
+     return ((replay*)user)->now;
+}
+
+static int rp_send(void* user, const u8* buf, int len)
+{
+     ((replay*)user)->sent += len;
+     return len;
+}
+
+static int rp_recv(void* user, u8* buf, int len)
+{
+replay* rp = user;
+
+     if ((rp->in == NULL) || (rp->in_pos >= rp->in_len))
+         return 0;                   // Nothing delivered yet, or all of it read
+     if (len > rp->in_len - rp->in_pos)
+         len = rp->in_len - rp->in_pos;
+     memcpy(buf, rp->in + rp->in_pos, len);
+     rp->in_pos += len;
+     return len;
+}
+
+static int rp_lines(void* user)
+{
+     return TIOCM_CTS;
+}
+
+static void rp_flush(void* user)
+{
+replay* rp = user;
+     rp->in_pos = rp->in_len;
+}
+
+
+/*
+ *
+ * load(): read a capture in memory
+ *
+ */
+int load(capture* cap, const char* name)
+{
+FILE* f;
+
+     cap->name = name;
+     f = fopen(name, "rb");
+     if (f == NULL)
+         return -1;
+     fseek(f, 0, SEEK_END);
+     cap->len = ftell(f);
+     fseek(f, 0, SEEK_SET);
+     cap->data = malloc(cap->len);
+     if ((cap->data == NULL) || (fread(cap->data, 1, cap->len, f) != cap->len))
+     {
+         fclose(f);
+         return -1;
+     }
+     fclose(f);
+     if ((cap->len < PSP_CAP_MAGIC_SIZE) || (memcmp(cap->data, PSP_CAP_MAGIC, PSP_CAP_MAGIC_SIZE) != 0))
+         return -1;
+     return 0;
+}
+
+
+/*
+ *
+ * run(): replay one capture through a fresh session. Returns the number
+ * of inbound bytes it went through
+ *
+ */
+long run(capture* cap, psp_stats* stats)
+{
+psp_ctx ctx;
+psp_io io;
+replay rp;
+psp_cap_rec rec;
+const u8* d;
+long pos, bytes = 0;
+int i, n;
+
+     memset(&rp, 0, sizeof(rp));
+     io.user = &rp;
+     io.now = rp_now;
+     io.send = rp_send;
+     io.recv = rp_recv;
+     io.lines = rp_lines;
+     io.flush = rp_flush;
+     psp_init(&ctx, &io, NULL);
+     ctx.lines.debounce = 0;         // The PSP is on from the start
+
+     for (pos = PSP_CAP_MAGIC_SIZE; pos + sizeof(rec) <= cap->len; pos += sizeof(rec) + rec.len)
+     {
+         memcpy(&rec, cap->data+pos, sizeof(rec));
+         if (pos + sizeof(rec) + rec.len > cap->len)
+             break;
+         d = cap->data + pos + sizeof(rec);
+         rp.now = rec.sec + rec.usec/1000000.0;
+
+         if (rec.dir == PSP_DIR_OUT)
+         {   // Queue the keys we sent again
+             for (i=0; i+5 < rec.len; i++)
+                 if ((d[i] == PSP_FRAME_START) && ((d[i+1] & 0xfe) == PSP_CMD_KEYS) &&
+                     (d[i+5] == PSP_FRAME_STOP) && (psp_queued(&ctx) < PSP_QUEUE_SIZE-2))
+                     psp_set_keys(&ctx, d[i+2] | (d[i+3]<<8));
+             psp_step(&ctx);
+             continue;
+         }
+
+         // Deliver what the PSP sent
+         rp.in = d;
+         rp.in_len = rec.len;
+         rp.in_pos = 0;
+         for (n=0; (n < MAX_STEPS) && (rp.in_pos < rp.in_len); n++)
+             psp_step(&ctx);
+         bytes += rec.len;
+     }
+
+     stats->sent += ctx.stats.sent;
+     stats->acked += ctx.stats.acked;
+     stats->received += ctx.stats.received;
+     stats->bad_frames += ctx.stats.bad_frames;
+     stats->errors += ctx.stats.errors;
+     return bytes;
+}
+
+
+/*
+ *
+ *
+ *
+ */
+int main (int argc, char *argv[])
+{
+capture* caps;
+psp_stats stats;
+struct timeval t0, t1;
+int opt_loops = DEFAULT_LOOPS;
+int opt_error = 0;
+int nb_caps, i, l;
+long bytes = 0;
+double elapsed;
+
+     while ((i = getopt (argc, argv, "hn:")) != -1)
+     switch (i)
+     {
+		case 'n':		// Number of replays
+			opt_loops = atoi(optarg);
+			break;
+		case 'h':
+		default:		// Unknown option
+			opt_error++;
+			break;
+     }
+
+     if ((optind >= argc) || (opt_error) || (opt_loops < 1))
+     {
+         printf ("usage: psp_bench [-n loops] capture [capture...]\n");
+         printf ("Replays captures from psp_remote -c through the protocol engine.\n");
+         printf ("Options:\n");
+         printf ("          -n loops : times the captures are replayed (default %d)\n\n", DEFAULT_LOOPS);
+         exit (1);
+     }
+
+     nb_caps = argc-optind;
+     caps = calloc(nb_caps, sizeof(capture));
+     for (i=0; i<nb_caps; i++)
+         if (load(&caps[i], argv[optind+i]) < 0)
+         {
+             fprintf(stderr, "%s: cannot load capture\n", argv[optind+i]);
+             exit(1);
+         }
+
+     memset(&stats, 0, sizeof(stats));
+     gettimeofday(&t0, NULL);
+     for (l=0; l<opt_loops; l++)
+         for (i=0; i<nb_caps; i++)
+             bytes += run(&caps[i], &stats);
+     gettimeofday(&t1, NULL);
+     elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec)/1000000.0;
+
+     printf("Replayed %d capture(s) %d times: %ld inbound bytes in %.3f s\n",
+            nb_caps, opt_loops, bytes, elapsed);
+     printf("Frames sent: %lu, acked: %lu, received: %lu, dropped: %lu\n",
+            stats.sent, stats.acked, stats.received, stats.bad_frames);
+     // Keep this one last, "make pgo" reads it
+     printf("Throughput: %.3f MB/s\n", (elapsed > 0)?bytes/elapsed/1000000.0:0);
+     return 0;
+}
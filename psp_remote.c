@@ -15,23 +15,22 @@
  * 
  * Notes:
  *
- * Most of the code below is based on the information provided by
- * Marcus Comstedt et al. at: http://mc.pp.se/psp/phones.xhtml and 
+ * This is the console front end. The protocol itself lives in
+ * libpspremote (pspremote.c), which is based on the information provided
+ * by Marcus Comstedt et al. at: http://mc.pp.se/psp/phones.xhtml and 
  * http://forums.ps2dev.org/viewtopic.php?t=986
  *
  */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <sys/time.h>                   
 #include <string.h>
-#include <ctype.h>
-#include <signal.h>               
-#include <termios.h>         
+#include <strings.h>
 #include <unistd.h>              
-#include <fcntl.h>              
-#include <sys/ioctl.h>               // serial line status
 #include <ncurses.h>                 // console I/O
 #include <getopt.h>                  // parameter processing
+#include "pspremote.h"               // protocol engine
 
 
 #define u8  unsigned char            // The usual supsect           
@@ -39,52 +38,35 @@
 
 #define NAME_SIZE   64               // Maximum device name size
 #define DEFAULT_DEV "/dev/ttyS0"     // port the device is plugged in to
-#define BAUDRATE    B4800            // baud rate the device spits out at
-#define BYTE_DELAY  2084             // Time it takes to send one byte 
-                                     // at above baudrate (in us)
 #define KB_DELAY    2                // Time spent waiting for keyboard (ms)
 #define KEY_TIMEOUT 50               // Duration for a pressed key to be highlighted
-#define MAX_BYTES   10               // Maximum number of bytes per frame
+
+// Simulation mode (emulated PSP on a virtual clock)
+#define SIM_DURATION  60             // Default simulated duration (s)
+#define SIM_KEY_MIN   200000         // Minimum delay between simulated keypresses (us)
+#define SIM_KEY_RND   1800000        // Random extra delay between simulated keypresses (us)
+#define SIM_GLITCH    5000000        // Time between simulated power glitches (us)
+
+#define TRACE_EVENTS  (1<<18)        // Size of the trace buffer (-t)
 
 // STDOUT functions for ncurses and timestamping
 #define POUT(win,args...)            { wprintw(win, ## args); wrefresh(win); }
-#define PSTATUS(color, arg)          { wattron(wstatus,COLOR_PAIR(color)); mvwprintw(wstatus, 0, 17, arg); wattroff(wstatus,COLOR_PAIR(color)); wrefresh(wstatus); }
-#define PKEYS(color, knum)           { wattron(wkeys,COLOR_PAIR(color)); mvwprintw(wkeys, kd[knum].y, kd[knum].x, "%s", kd[knum].txt); wattroff(wkeys,COLOR_PAIR(color)); wrefresh(wkeys); }
-#define PERR(args...)                { sprintf(s, ## args); POUT(werr, "\n[%03.3f] %s", timestamp(), s); }
-#define PLOG(args...)                { sprintf(s, ## args); POUT(wlog, "\n[%03.3f] %s", timestamp(), s); }
-#define PSENT(arg)                   { mvwprintw(wcommands, 0, 24, "%s [%3.3f]", arg,  timestamp()); wrefresh(wcommands); }
-#define PRECVD(arg)                  { mvwprintw(wcommands, 1, 24, "%s [%3.3f]", arg,  timestamp()); wrefresh(wcommands); }
+#define PSTATUS(color, arg)          if (wstatus) { wattron(wstatus,COLOR_PAIR(color)); mvwprintw(wstatus, 0, 17, arg); wattroff(wstatus,COLOR_PAIR(color)); wrefresh(wstatus); }
+#define PKEYS(color, knum)           if (wkeys) { wattron(wkeys,COLOR_PAIR(color)); mvwprintw(wkeys, kd[knum].y, kd[knum].x, "%s", kd[knum].txt); wattroff(wkeys,COLOR_PAIR(color)); wrefresh(wkeys); }
+#define PERR(args...)                { sprintf(s, ## args); on_log(NULL, PSP_LOG_ERR, s); }
+#define PLOG(args...)                { sprintf(s, ## args); on_log(NULL, PSP_LOG_INFO, s); }
+#define PSENT(arg)                   { if (wcommands) { mvwprintw(wcommands, 0, 24, "%s [%3.3f]", arg,  timestamp()); wrefresh(wcommands); } }
+#define PRECVD(arg)                  { if (wcommands) { mvwprintw(wcommands, 1, 24, "%s [%3.3f]", arg,  timestamp()); wrefresh(wcommands); } }
 //  
 #define FLUSHER			     { while(getchar() != 0x0A); }
-#define ERR_EXIT		     { if (fd_serial >= 0) close(fd_serial); fflush(stdin); exit(1); }
-
-// List of known PSP commands
-#define CMD_QUERY       0x02
-#define CMD_INIT	0x80
-#define CMD_ID		0x82
-#define CMD_KEYS	0x84
-
-// List of known PSP frame delimiters
-#define FRAME_RTS       0xf0         // Request To Send = "I want to speak"
-#define FRAME_CTS       0xf8         // Clear To Send = "Go ahead and speak"
-#define FRAME_START     0xfd         // Message begins
-#define FRAME_STOP      0xfe         // Message ends
-#define FRAME_ACK0      0xfa         // Message received ok (phase 0)
-#define FRAME_ACK1      0xfb         // Message received ok (phase 1)
-
-// Current processing state
-#define STATE_OFFLINE   0x00         // PSP is not powering up the serial port 
-#define STATE_ONLINE    0x01         // PPS is powering serial port (2.5V on pin 5)
-#define STATE_RESET     0x02         // We just went back on
-#define STATE_RTS	0x04         // Request To Send has been received FROM the PSP
-#define STATE_CTS       0x08         // Clear To Send has been received FROM the PSP
-#define STATE_WAIT_ACK	0x10         // Pending ACK FROM the PSP (after message has been sent)
+#define ERR_EXIT		     { psp_close(&ctx); fflush(stdin); exit(1); }
 
 // Ncurses stuff
 #define MAX_W      80                // Max horizontal width
 // Our various windows height definition
 #define STATUS_H    1
-#define KEYS_H      3
+#define KEYS_H      3                // Two rows of keys, a line apart
+#define KEYS_ROW    5                // Keys shown per row
 #define COMMANDS_H  2
 #define LOG_H      10
 #define ERR_H       2
@@ -92,423 +74,323 @@
 typedef struct {
 int x;
 int y;
-char* txt;
-int timeout;
+char txt[24];
+double timeout;                      // Time at which the highlight expires (-1 if none)
 } ktxt;
-ktxt kd[10];
-
-// Definition of the commands we will enqueue 
-typedef struct {
-   u8 command;
-   int size;
-   u8 data[MAX_BYTES];
-} R_Cmd;
-
-// The command queue
-R_Cmd cmd_table[16];
-int cmd_pos = 0;
-int cmd_end = 0;
-char s[256];
-
-// Buffer for sending data
-u8 write_buffer[MAX_BYTES+3];
+ktxt kd[PSP_KEYMAP_BINDINGS];
 
-// Rotating buffer for input
-u8 data_buffer[256];
-u8 data_pos = 0;
-u8 data_end = 0;
+// Which key sends what
+psp_keymap keymap;
 
-// Rotating buffer is full
-int overflow = 0;
+char s[256];
 
-// Serial port file descriptor
-int fd_serial = 0; 
+// The protocol session, and the emulated PSP when simulating
+psp_ctx ctx;
+psp_sim sim;
 
 // Commandline options
 int opt_verbose;
-
-// Current processing state
-int state = STATE_OFFLINE;
-
-// Sony's weird phase game
-u8 inbound_phase = 0;
-u8 outbound_phase = 0;
-
-// The origin of times ;)
-double t0;
+int opt_sim;
+int opt_flood;
+int opt_nopipe;
+double opt_duration = SIM_DURATION;
+double opt_noise = 0;
+double opt_glitch = 0;
+double opt_debounce = PSP_DEBOUNCE * 1000.0;
+char* opt_capture = NULL;
+char* opt_trace = NULL;
+char* opt_keys = NULL;
+unsigned int opt_seed = 1;
 
 // Keys flags
 int keypressed = 0;
 int hold = 0;
+int nb_keys = 0;
+int nb_resets = 0;                   // Times the session was (re)started
+
+// Timeline of the session (-t)
+psp_trace timeline;
+
+// Simulated user
+psp_vtime sim_next_key = 0;
+unsigned int sim_rand;
 
-// ncurses windows
+// ncurses windows (all NULL when running headless)
 WINDOW *wstatus, *wkeys, *wcommands, *wlog, *werr;
 
-// serial interrupt handler prototype
-void serial_handler();
+// Keyboard input (ERR if none)
+int (*getkey)();
+
+// Capture file, and the I/O we record
+FILE* cap_file = NULL;
+psp_io cap_io;
 
 // An inline timestamping function would be better but we don't really care
 double timestamp ()
 {
-struct timeval t;
-     gettimeofday(&t, (struct timezone *)0);
-     return t.tv_sec * 1.0 + (double)t.tv_usec / 1000000.0 - t0;
+     return psp_time(&ctx);
 }
-                  
+
 
 /*
  *
- * Don't even think about suing!
+ * Protocol engine callbacks
  *
  */
-int print_disclaimer()
+void on_log(void* user, int level, const char* msg)
 {
-	char c;
-	puts("                       DISCLAIMER");
-	puts("");
-	puts("THIS PROGRAM IS PROVIDED \"AS IS\" WITHOUT WARRANTY OF ANY KIND,");
-	puts("EITHER EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO,"); 
-	puts("THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A");
-	puts("PARTICULAR PURPOSE.");
-	puts("");
-	puts("THE ENTIRE RISK AS TO THE ABILITY OF THIS PROGRAM TO INTERFACE");
-	puts("WITH THE REMOTE PORT OF A SONY PORTABLE PLAYSTATION (PSP) IS");
-        puts("WITH YOU. SHOULD THE PROGRAM PROVE DEFECTIVE, YOU ASSUME THE");
-        puts("COST OF ALL NECESSARY SERVICING, REPAIR OR CORRECTION.");
-	puts("");
-	puts("IF YOU UNDERSTAND THE RISKS ASSOCIATED WITH THIS PROGRAM AND");
-	puts("DISCHARGE BOTH THE AUTHOR AND SONY CORPORATION FROM ANY");
-	puts("DAMAGE OCCURING AS THE RESULT OF ITS USE, PLEASE INDICATE SO");
-	puts("BY ANSWERING THE FOLLOWING QUESTION:");
-	puts("");
-	puts("Do you understand and agree to the statement above (y/n)?");
-        fflush(stdin);
+     if (level == PSP_LOG_ERR)
+     {
+         if (werr) 
+             POUT(werr, "\n[%03.3f] %s", timestamp(), msg)
+         else
+             printf("[%03.3f] ERR %s\n", timestamp(), msg);
+     }
+     else
+     {
+         if (wlog)
+             POUT(wlog, "\n[%03.3f] %s", timestamp(), msg)
+         else if (opt_verbose)
+             printf("[%03.3f] %s\n", timestamp(), msg);
+     }
+}
 
-	c = (char) getchar();
-	FLUSHER;
-	if ((c!='y') && (c!='Y'))
-	{
-		fprintf(stderr, "Operation cancelled by user.\n");
-		return -1;
-	}
-	puts("");
-	return 0;
+void on_state(void* user, int old_state, int new_state)
+{
+     if ((new_state & PSP_STATE_ONLINE) == (old_state & PSP_STATE_ONLINE))
+         return;
+     if (new_state & PSP_STATE_ONLINE)
+     {   nb_resets++; PSTATUS(4, "ONLINE "); }
+     else
+     {   PSTATUS(3, "OFFLINE"); }
 }
 
+void on_frame(void* user, int dir, u8 command, const u8* data, int size)
+{
+char name[16];
+
+     // Displays the last command in the commands window
+     sprintf(name, "%-9s", psp_cmd_name(command));
+     if (dir == PSP_DIR_OUT)
+         PSENT(name)
+     else
+         PRECVD(name)
+}
+
+psp_callbacks callbacks = { NULL, on_log, on_state, on_frame };
 
 
 /*
- * 
- * enqueue(): bufferize commands to send into a rotating command buffer
+ *
+ * Capture: record everything that goes through the serial line
  *
  */
-int enqueue(u8 command, char* strdata)
+void cap_write(void* user, int dir, const u8* buf, int len)
 {
-int i, j, len, size;
-char c;
-u8 nib = 0;	// init here prevents a warning there
-
-    // Fill in the command
-    cmd_table[cmd_end].command = command;
-
-    // Init size
-    size = 0;
-
-    // We might as well do the hex -> bin conversion ourselves
-    len = strlen(strdata);
-
-    // Quick check
-    if ((len%3) != 2)
-    {
-        PERR("data '%s' is not in format 'xx xx xx .. xx' (trailing space?)", strdata);
-        return 1; 
-    }
-
-    // Do the hex -> nibble character conversion
-    for (i=0; i<len; i+=3)
-    {
-        // Check that we have spaces as separators
-        if ((i+2 < len) && (strdata[i+2] != ' '))
-        {
-            PERR("data '%s' is not in format 'xx xx xx ... xx'", strdata);
-            return 1; 
-        }
-        
-        // hex -> bin
-        for (j=0; j<2; j++)
-        {
-            nib = nib<<4;   // a shift forces LSb to 0
-            c = toupper(strdata[i+j]);		// read uppercase char
-            if ((c>='0')&&(c<='9'))
-                nib |= c&0x0f;
-            else if ((c>='A')&&(c<='F'))
-                nib |= c-0x37;
-            else
-            {
-                PERR("Invalid hex character: %c", strdata[i]);
-                return 1;
-            }
-        }
-
-        // Write data into the command data table and increment size
-        cmd_table[cmd_end].data[size++] = nib;
-    }
-
-    // Fill in with computed data size
-    cmd_table[cmd_end].size = size;
-
-    // Rotating buffer 
-    cmd_end = (cmd_end+1) & 0x0F;
-
-    return 0;
+psp_cap_rec rec;
+double t = cap_io.now(user);
+
+     rec.sec = (unsigned int)t;
+     rec.usec = (unsigned int)((t - rec.sec) * 1000000.0);
+     rec.len = len;
+     rec.dir = dir;
+     rec.pad = 0;
+     fwrite(&rec, sizeof(rec), 1, cap_file);
+     fwrite(buf, 1, len, cap_file);
 }
 
+int cap_send(void* user, const u8* buf, int len)
+{
+int r = cap_io.send(user, buf, len);
+     if (r > 0)
+         cap_write(user, PSP_DIR_OUT, buf, r);
+     return r;
+}
 
-/*
- *
- * check_status(): Monitor serial port status
- *
- */
-int check_status()
+int cap_recv(void* user, u8* buf, int len)
 {
-int serial_status;
-
-    // Clear RESET flag if set
-    if (state & STATE_RESET)
-        state &= ~STATE_RESET;
-
-    // Check for any change of RS232_CTS, to indicate whether the device is powered
-    ioctl(fd_serial, TIOCMGET, &serial_status);
-    if (serial_status & TIOCM_CTS)
-    {   // RS323_CTS is on 
-        if (!(state & STATE_ONLINE))
-        {   // We just went back on
-            state = STATE_ONLINE | STATE_RESET; 
-            PSTATUS(4, "ONLINE ");
-
-            // Reset data buffer
-            data_pos = 0;
-            data_end = 0;
-
-            // Reset command buffer
-            cmd_pos = 0;
-            cmd_end = 0;
-
-            // Enqueue init commands
-            enqueue(CMD_INIT, "01 01 01");
-            enqueue(CMD_ID, "01 A8 00 47");
-        }
-    }
-    else
-    {   // RS232_CTS is off => PSP has cut serial line power
-        if (state & STATE_ONLINE)
-        {   // We just went offline
-            tcflush(fd_serial, TCIFLUSH);   // flush serial port
-            PSTATUS(3, "OFFLINE"); 
-        }
-        state = STATE_OFFLINE;
-    }
-
-    // TO_DO: Check for break 
-
-    return 0;
+int r = cap_io.recv(user, buf, len);
+     if (r > 0)
+         cap_write(user, PSP_DIR_IN, buf, r);
+     return r;
+}
+
+int cap_open(char* filename)
+{
+     cap_file = fopen(filename, "wb");
+     if (cap_file == NULL)
+         return -1;
+     fwrite(PSP_CAP_MAGIC, 1, PSP_CAP_MAGIC_SIZE, cap_file);
+     // Slip ourselves between the engine and its I/O
+     cap_io = ctx.io;
+     ctx.io.send = cap_send;
+     ctx.io.recv = cap_recv;
+     return 0;
 }
 
 
 /*
  *
- * process_command: Process any inbound command from the PSP
+ * Tracing: a timeline of the session, saved on exit
  *
  */
-int process_command(u8 command)
+int trace_open()
 {
-    // TO_DO: add a size check from associative array
-
-    // Don't bother checking the inbound phase - just accept it
-    inbound_phase = command & 0x01;
-
-    switch(command & 0xfe)
-    {
-        case CMD_QUERY:
-            PLOG("Received CMD_QUERY: %02X", data_buffer[data_pos]);
-            PRECVD("CMD_QUERY");
-            if (data_buffer[data_pos] == 0x01)
-            {   // Only answer first time round
-                PLOG("enqueue CMD_KEYS");
-                enqueue(CMD_KEYS, "00 00");
-            }
-            data_pos+=2; // TODO: checksum
-            if (data_buffer[data_pos++] != 0xfe)
-                PERR("Error: missing FE frame end");
-            return 0;
-        default:
-            PLOG("Received UNKNOWN COMMAND %02X", command);
-            PRECVD("UNKNOWN");
-            // /!\ THIS WILL NOT WORK IF THERE IS AN FE IN THE DATA
-            while (data_buffer[data_pos] != 0xfe);
-            return 0;
-    }
+psp_trace_event* events = malloc(TRACE_EVENTS * sizeof(psp_trace_event));
+
+     if (events == NULL)
+         return -1;
+     psp_trace_init(&timeline, events, TRACE_EVENTS);
+     ctx.trace = &timeline;
+     return 0;
+}
+
+void trace_close()
+{
+     if (!opt_trace)
+         return;
+     if (psp_trace_save(&timeline, opt_trace) < 0)
+         printf("Unable to write trace file (%s)\n", opt_trace);
+     else if (timeline.dropped)
+         printf("Trace buffer full: %lu events dropped\n", timeline.dropped);
+     free(timeline.events);
 }
 
 
 /*
  *
- * read_data: incoming
+ * Keyboard input: ncurses, or a simulated user on the virtual clock
  *
  */
-int read_data()
+int rt_getkey()
+{
+     return getch();
+}
+
+// Names of the ncurses keys that can be used in a key profile
+int rt_keyname(const char* name)
+{
+static const struct {
+   const char* name;
+   int key;
+} names[] = {
+   { "UP", KEY_UP }, { "DOWN", KEY_DOWN }, { "LEFT", KEY_LEFT }, { "RIGHT", KEY_RIGHT },
+   { "HOME", KEY_HOME }, { "END", KEY_END }, { "PGUP", KEY_PPAGE }, { "PGDN", KEY_NPAGE },
+   { "INS", KEY_IC }, { "DEL", KEY_DC }, { "BACKSPACE", KEY_BACKSPACE },
+};
+char* end;
+long f;
+int i;
+
+     // F1 to F12, and nothing else after
+     if (((name[0] == 'F') || (name[0] == 'f')) && (name[1] >= '1') && (name[1] <= '9'))
+     {
+         f = strtol(name+1, &end, 10);
+         return ((*end == 0) && (f <= 12))?KEY_F(f):-1;
+     }
+     for (i=0; i<sizeof(names)/sizeof(names[0]); i++)
+         if (strcasecmp(name, names[i].name) == 0)
+             return names[i].key;
+     return -1;
+}
+
+// Deterministic PRNG, so that a given seed always replays the same session
+unsigned int sim_random(unsigned int n)
 {
-u8 frame;
-u8 command;
-
-    if (data_pos != data_end)
-    {
-       frame = data_buffer[data_pos++];
-
-       switch(frame)
-       {
-           // We are receiving a Request To Send from the PSP => Send Clear To Send
-           case FRAME_RTS:
-               PLOG("Received: FRAME_RTS");
-               state |= STATE_RTS;
-               write_buffer[0] = FRAME_CTS;
-               if (write(fd_serial, write_buffer, 1) != 1)
-                   PERR("Error Sending CTS");
-               break;
-
-           // We are receiving CTS on a previous RTS we sent
-           case FRAME_CTS:
-               PLOG("Received: FRAME_CTS");
-               state |= STATE_CTS;
-               break;
-
-           // The PSP is ack'ing a previous command we sent
-           case FRAME_ACK0:
-           case FRAME_ACK1:
-               PLOG("Received FRAME_ACK");
-               if (!(state & STATE_WAIT_ACK))
-                    PERR("Received ACK while not waiting for ACK!");
-               state &= ~(STATE_WAIT_ACK | STATE_CTS);
-               // Process next command
-               cmd_pos = (cmd_pos+1) & 0x0f;
-               if ((frame & 0x01) != outbound_phase)
-                   PERR("Phase read from PSP on ack does not match our outbound phase!")
-               else
-                   // Toggle phase
-                   outbound_phase = (outbound_phase)? 0:1;
-               break;
-
-           // The PSP is sending a command
-           case FRAME_START:
-               PLOG("FRAME_START");
-               // Read command
-               if (data_pos == data_end)
-               {   // rest of data is not in yet. Try to wait for it
-                   PERR("FRAME_START but no command - trying again");
-                   usleep(MAX_BYTES*BYTE_DELAY);
-                   if (data_pos == data_end)
-                   {   // Still nothing
-                       PERR("Frame start but no command.");
-                       return -1;
-                   }
-               }
-               // Isolate the command byte and process it
-               command = data_buffer[data_pos++];
-               process_command(command);
-
-               // Acknowledge
-               write_buffer[0] = FRAME_ACK0 | inbound_phase;
-               if (write(fd_serial, write_buffer, 1) != 1)
-                   PERR("Error writing ACK");
-               
-               state &= ~STATE_RTS;
-               break;
-
-           // Who knows...
-           default:
-               PLOG("Unknown Frame: %02X", frame);
-               break;
-               
-        }
-    }
-    return 0;
+     sim_rand = sim_rand * 1103515245 + 12345;
+     return (sim_rand >> 8) % n;
 }
 
+// Virtual time of a deadline, rounded up so that it has passed by then
+psp_vtime sim_vtime(double t)
+{
+psp_vtime v = (psp_vtime)(t * 1000000.0);
+
+     if (v < t * 1000000.0)
+         v++;
+     return v;
+}
+
+int sim_getkey()
+{
+psp_vtime end = (psp_vtime)(opt_duration * 1000000.0);
+psp_vtime next, t;
+int i;
+
+     if (sim.clock >= end)
+         return 0x1B;
+
+     // Keep the link busy, to see how many frames it can take
+     if ((opt_flood) && (ctx.state & PSP_STATE_ONLINE) && (psp_queued(&ctx) < 2))
+         return keymap.bindings[sim_random(keymap.nb)].key;
+
+     if (sim.clock >= sim_next_key)
+     {
+         sim_next_key = sim.clock + SIM_KEY_MIN + sim_random(SIM_KEY_RND);
+         return keymap.bindings[sim_random(keymap.nb)].key;
+     }
+
+     // Behave like getch() timing out...
+     next = sim.clock + KB_DELAY*1000;
+     // ...unless the engine is idle, in which case we skip to the next event
+     if ((!psp_busy(&ctx)) && (!keypressed))
+     {
+         next = end;
+         if (sim_next_key < next)
+             next = sim_next_key;
+         t = psp_sim_next_event(&sim);
+         if (t < next)
+             next = t;
+         if ((psp_deadline(&ctx) > 0) && (sim_vtime(psp_deadline(&ctx)) < next))
+             next = sim_vtime(psp_deadline(&ctx));
+         for (i=0; i<keymap.nb; i++)
+             if ((kd[i].timeout >= 0) && (sim_vtime(kd[i].timeout) < next))
+                 next = sim_vtime(kd[i].timeout);
+         if (next < sim.clock + KB_DELAY*1000)
+             next = sim.clock + KB_DELAY*1000;
+     }
+     psp_sim_advance(&sim, next);
+     return ERR;
+}
+                  
 
 /*
  *
- * write_data: outbound
+ * Don't even think about suing!
  *
  */
-int write_data()
+int print_disclaimer()
 {
-u8 checksum;
-int len;
-int i;
+	char c;
+	puts("                       DISCLAIMER");
+	puts("");
+	puts("THIS PROGRAM IS PROVIDED \"AS IS\" WITHOUT WARRANTY OF ANY KIND,");
+	puts("EITHER EXPRESSED OR IMPLIED, INCLUDING, BUT NOT LIMITED TO,"); 
+	puts("THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A");
+	puts("PARTICULAR PURPOSE.");
+	puts("");
+	puts("THE ENTIRE RISK AS TO THE ABILITY OF THIS PROGRAM TO INTERFACE");
+	puts("WITH THE REMOTE PORT OF A SONY PORTABLE PLAYSTATION (PSP) IS");
+        puts("WITH YOU. SHOULD THE PROGRAM PROVE DEFECTIVE, YOU ASSUME THE");
+        puts("COST OF ALL NECESSARY SERVICING, REPAIR OR CORRECTION.");
+	puts("");
+	puts("IF YOU UNDERSTAND THE RISKS ASSOCIATED WITH THIS PROGRAM AND");
+	puts("DISCHARGE BOTH THE AUTHOR AND SONY CORPORATION FROM ANY");
+	puts("DAMAGE OCCURING AS THE RESULT OF ITS USE, PLEASE INDICATE SO");
+	puts("BY ANSWERING THE FOLLOWING QUESTION:");
+	puts("");
+	puts("Do you understand and agree to the statement above (y/n)?");
+        fflush(stdin);
 
-   // Don't do anything if we're not online
-   if (!(state & STATE_ONLINE))
-       return 0;
-
-   // Check if we have a command to send AND the PSP is not in the process of sending one to us
-   // AND we are not waiting for a previous command to be acknowledged
-   if ((cmd_pos != cmd_end) && (!(state & STATE_RTS)) && (!(state & STATE_WAIT_ACK)))
-   {   // We are good to send
-       // Did we receive CTS from PSP yet?
-       if (state & STATE_CTS)
-       {   
-           // Send command 
-           PLOG("Sending command %02X", cmd_table[cmd_pos].command);
-           len = 0;
-           // Frame start delimiter 
-           write_buffer[len++] = FRAME_START;
-           // We need to compute checksum too => init
-           checksum = cmd_table[cmd_pos].command | outbound_phase;
-           // Write command
-           write_buffer[len++] = checksum;
-           // Write data
-           for (i=0; i<cmd_table[cmd_pos].size; i++)
-           {
-               write_buffer[len] = cmd_table[cmd_pos].data[i];
-               checksum ^= write_buffer[len++];
-           }
-           // Write checksum
-           write_buffer[len++] = checksum;
-           // Frame stop delimiter
-           write_buffer[len++] = FRAME_STOP;
-           
-           // Write to serial port
-           if (write(fd_serial, write_buffer, len) != len)
-               PERR("Error writing frame");
-           // Change the state 
-           state |= STATE_WAIT_ACK;
-           state &= ~STATE_RTS;
-
-           // Displays the command we just sent in the commands window
-           switch(cmd_table[cmd_pos].command)
-           {
-               case CMD_INIT:
-                   PSENT("CMD_INIT ");
-                   break;
-               case CMD_ID:
-                   PSENT("CMD_ID   ");
-                   break;
-               case CMD_KEYS:
-                   PSENT("CMD_KEYS ");
-                   break;
-               default:
-                   PSENT("?????    ");
-                   break;
-           }
-       }
-       else
-       {   // No CTS received yet => keep sending RTS
-           write_buffer[0] = FRAME_RTS;
-           if (write(fd_serial, write_buffer, 1) != 1)
-              PERR("Error sending RTS");
-       }
-   }
-   return 0;
+	c = (char) getchar();
+	FLUSHER;
+	if ((c!='y') && (c!='Y'))
+	{
+		fprintf(stderr, "Operation cancelled by user.\n");
+		return -1;
+	}
+	puts("");
+	return 0;
 }
 
 
@@ -519,40 +401,25 @@ int i;
  */
 int init_screen()
 {
+static const int key_x[KEYS_ROW] = { 2, 18, 32, 50, 64 };
+static const int key_w[KEYS_ROW] = { 15, 13, 17, 13, 13 };
 int y = 0;
+int rows, keys_h, log_h;
 int i;
 
-     // keys definition and positioning
-     kd[0].x = 2;
-     kd[0].y = 0;
-     kd[0].txt = "0: Play/Pause";
-     kd[1].x = 18;
-     kd[1].y = 0;
-     kd[1].txt = "1: [0x0002]";
-     kd[2].x = 32;
-     kd[2].y = 0;
-     kd[2].txt = "2: Fast Forward";
-     kd[3].x = 50;
-     kd[3].y = 0;
-     kd[3].txt = "3: Rewind";
-     kd[4].x = 64;
-     kd[4].y = 0;
-     kd[4].txt = "4: Vol +";
-     kd[5].x = 2;
-     kd[5].y = 2;
-     kd[5].txt = "5: Vol -";
-     kd[6].x = 18;
-     kd[6].y = 2;
-     kd[6].txt = "6: [0x0040]";
-     kd[7].x = 32;
-     kd[7].y = 2;
-     kd[7].txt = "7: Hold";
-     kd[8].x = 50;
-     kd[8].y = 2;
-     kd[8].txt = "8: [0x0100]";
-     kd[9].x = 64;
-     kd[9].y = 2;
-     kd[9].txt = "9: [0x0200]";
+     // keys definition and positioning, KEYS_ROW per row. Past two rows,
+     // they go on every line, and the log gives up the extra lines so that
+     // the whole thing still fits in 80x24
+     rows = (keymap.nb + KEYS_ROW-1) / KEYS_ROW;
+     keys_h = (rows > 2)?rows:KEYS_H;
+     log_h = LOG_H - (keys_h - KEYS_H);
+     for (i=0; i<keymap.nb; i++)
+     {
+         kd[i].x = key_x[i % KEYS_ROW];
+         kd[i].y = (i / KEYS_ROW) * ((rows > 2)?1:2);
+         snprintf(kd[i].txt, sizeof(kd[i].txt), "%s: %s", keymap.bindings[i].name, keymap.bindings[i].label);
+         kd[i].txt[key_w[i % KEYS_ROW]] = 0;
+     }
 
      // ncurses init
      initscr();
@@ -566,6 +433,9 @@ int i;
      nonl();
      curs_set(0);
      keypad(stdscr, FALSE);    // this allows numpad entry as well
+     for (i=0; i<keymap.nb; i++)
+         if (keymap.bindings[i].key > 0xff)
+             keypad(stdscr, TRUE);     // ...but the profile uses function keys
      timeout(KB_DELAY);
 
      // Use colour for the keys
@@ -599,10 +469,10 @@ int i;
      y++;
  
      // Keys description window
-     wkeys = newwin(KEYS_H, MAX_W-2, y, 1);
-     mvvline(y, 0, ACS_VLINE, KEYS_H);
-     mvvline(y, MAX_W-1, ACS_VLINE, KEYS_H);
-     y+=KEYS_H;
+     wkeys = newwin(keys_h, MAX_W-2, y, 1);
+     mvvline(y, 0, ACS_VLINE, keys_h);
+     mvvline(y, MAX_W-1, ACS_VLINE, keys_h);
+     y+=keys_h;
 
      // Separator
      mvaddch(y, 0, ACS_LTEE);
@@ -623,10 +493,10 @@ int i;
      y++;
 
      // Log window
-     wlog = newwin(LOG_H, MAX_W-4, y, 3);
-     mvvline(y, 0, ACS_VLINE, LOG_H);
-     mvvline(y, MAX_W-1, ACS_VLINE, LOG_H);
-     y+=LOG_H;
+     wlog = newwin(log_h, MAX_W-4, y, 3);
+     mvvline(y, 0, ACS_VLINE, log_h);
+     mvvline(y, MAX_W-1, ACS_VLINE, log_h);
+     y+=log_h;
 
      // Separator
      mvaddch(y, 0, ACS_LTEE);
@@ -660,7 +530,7 @@ int i;
 
      // Populate the keys window
      wattron(wkeys,COLOR_PAIR(1));
-     for (i=0; i<10; i++)
+     for (i=0; i<keymap.nb; i++)
          mvwprintw(wkeys, kd[i].y, kd[i].x, "%s", kd[i].txt);
      wattroff(wkeys,COLOR_PAIR(1));
      wrefresh(wkeys);
@@ -682,42 +552,51 @@ int i;
 int process_keyboard()
 {
 int ch,num;  
-char keys[8];
 u16 keyval;
+const psp_binding* b;
+double t;
 
-     ch = getch();         // This is where KB_DELAY applies
+     ch = getkey();        // This is where KB_DELAY applies
+     t = timestamp();
      // Test for Esc key
-     if (ch == 0x1B)
+     if (ch == PSP_KEYMAP_QUIT)
         return -1;
-     // Test for a numeric key
-     if ( (ch != ERR) && ((ch >= 0x30) && (ch <= 0x39)) )
+     // Test for a bound key
+     if ( (ch != ERR) && ((b = psp_keymap_find(&keymap, ch)) != NULL) )
      {
-         num = ch&0x0f;
-         keyval = (1<<num);
+         num = b - keymap.bindings;
+         keyval = b->mask;
          keypressed = -1;
          PKEYS(2, num);
-         kd[num].timeout = KEY_TIMEOUT;
-         sprintf(keys, "%02X %02X", (u8)keyval, (u8)(keyval>>8));
-         PLOG("enqueuing CMD_KEYS: %s", keys);
-         enqueue(CMD_KEYS,keys);
+         kd[num].timeout = timestamp() + KEY_TIMEOUT/1000.0;
+         nb_keys++;
+         PLOG("enqueuing CMD_KEYS: %02X %02X", (u8)keyval, (u8)(keyval>>8));
+         psp_set_keys(&ctx, keyval);
+         if (opt_trace)
+             psp_trace_span(&timeline, PSP_TRACE_CLIENT, "process_keyboard", "key", ch, t, timestamp());
      }
      // Send the key depress command
      else if (keypressed)
      {
          if (opt_verbose)
             PLOG("enqueuing CMD_KEYS: 00 00 (key depressed)");
-         enqueue(CMD_KEYS,"00 00");
-         keypressed = 0;
+         // Refused => still held on the PSP, try again next time round
+         if (psp_set_keys(&ctx, 0) == 0)
+             keypressed = 0;
+         if (opt_trace)
+             psp_trace_span(&timeline, PSP_TRACE_CLIENT, "process_keyboard", "release", -1, t, timestamp());
      }
-     for (num=0; num<10; num++)
+     for (num=0; num<keymap.nb; num++)
      {
-         if (kd[num].timeout != -1)
+         if (kd[num].timeout >= 0)
          {
-             kd[num].timeout -= KB_DELAY;
-             if (kd[num].timeout < 0)
+             if (kd[num].timeout <= timestamp())
              {
+                 t = timestamp();
                  PKEYS(1, num);
                  kd[num].timeout = -1;
+                 if (opt_trace)
+                     psp_trace_span(&timeline, PSP_TRACE_CLIENT, "refresh", "key", keymap.bindings[num].key, t, timestamp());
              }
          }
      }
@@ -732,23 +611,56 @@ u16 keyval;
  */
 int main (int argc, char *argv[])
 {
-struct timeval tm;
-struct termios tty;             // will be used for new port settings
-struct termios oldtty;          // will be used to save old port settings
-struct sigaction saio;          // serial interrupt
 char devname[NAME_SIZE] = DEFAULT_DEV;
+psp_io io;
+psp_line_event history[PSP_LINE_HISTORY];
+static const char* line_event[] = { "EDGE", "UP", "DOWN", "GLITCH", "BREAK" };
 int quit = 0; 
 int opt_error = 0;	// getopt
-int i;
+int i, n;
 
      fflush(stdin);
+     psp_keymap_default(&keymap);
 
-     while ((i = getopt (argc, argv, "hv")) != -1)
+     while ((i = getopt (argc, argv, "hvsfnd:r:e:g:b:c:t:k:")) != -1)
      switch (i)
      {
 		case 'v':		// Print verbose messages
 			opt_verbose++;
 			break;
+		case 's':		// Simulate the PSP on a virtual clock
+			opt_sim++;
+			break;
+		case 'f':		// Simulated user presses keys as fast as they go out
+			opt_flood++;
+			break;
+		case 'd':		// Simulated duration
+			opt_duration = atof(optarg);
+			break;
+		case 'r':		// Simulation seed
+			opt_seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':		// Simulated line noise
+			opt_noise = atof(optarg);
+			break;
+		case 'g':		// Simulated power glitches
+			opt_glitch = atof(optarg);
+			break;
+		case 'n':		// One frame at a time
+			opt_nopipe++;
+			break;
+		case 'b':		// Debounce window for the PSP's power
+			opt_debounce = atof(optarg);
+			break;
+		case 'c':		// Capture file
+			opt_capture = optarg;
+			break;
+		case 't':		// Trace file
+			opt_trace = optarg;
+			break;
+		case 'k':		// Key profile
+			opt_keys = optarg;
+			break;
 		case 'h':
 		default:		// Unknown option
 			opt_error++;
@@ -758,105 +670,141 @@ int i;
      printf ("\npsp_remote v1.00 : Sony PSP, serial software remote\n");
      printf ("by >NIL:, July 2005\n\n");
 
-     if ( ((argc-optind) > 1) || (opt_error) )
+     if ( ((argc-optind) > 1) || (opt_error) || ((opt_sim) && (argc-optind)) )
      {
-         printf ("usage: psp_emote [-v] [device]\n");
+         printf ("usage: psp_emote [-v] [-n] [-k file] [-b ms] [-c file] [-t file] [device]\n");
+         printf ("       psp_emote -s [-v] [-n] [-k file] [-b ms] [-c file] [-t file] [-d seconds] [-r seed] [-e rate] [-g ms] [-f]\n");
          printf ("If no device is given, psp_remote will use %s\n", DEFAULT_DEV);
          printf ("Options:\n");
-         printf ("                -v : verbose\n\n");
+         printf ("                -v : verbose\n");
+         printf ("           -k file : key profile, binding keys to remote keys (see psp_remote.keys)\n");
+         printf ("                -n : don't ask for the line until the PSP has acknowledged the last frame\n");
+         printf ("             -b ms : time a change of the PSP's power must hold for (default %g)\n", PSP_DEBOUNCE*1000.0);
+         printf ("           -c file : capture the serial traffic to file (see psp_analyze)\n");
+         printf ("           -t file : save a timeline of the session to file (Chrome trace format)\n");
+         printf ("                -s : simulate a PSP on a virtual clock (no device, no screen)\n");
+         printf ("        -d seconds : simulated duration (default %d)\n", SIM_DURATION);
+         printf ("           -r seed : simulated keypresses seed (default 1)\n");
+         printf ("           -e rate : simulated line noise, as corrupted bytes per byte\n");
+         printf ("             -g ms : simulated power glitches, every %d s\n", SIM_GLITCH/1000000);
+         printf ("                -f : simulated keypresses as fast as the link takes them\n\n");
          exit (1);
      }
 
+     if ((opt_keys) && (psp_keymap_load(&keymap, opt_keys, rt_keyname) < 0))
+     {
+         printf ("%s\n", keymap.error);
+         exit (1);
+     }
+
+     if (opt_sim)
+     {   // Headless run against the emulated PSP
+         psp_sim_init(&sim, PSP_SIM_POWER_ON);
+         sim.noise = opt_noise;
+         sim.seed = opt_seed;
+         if (opt_glitch > 0)
+         {
+             sim.glitch_period = SIM_GLITCH;
+             sim.glitch_len = (psp_vtime)(opt_glitch * 1000.0);
+         }
+         psp_sim_io(&sim, &io);
+         psp_init(&ctx, &io, &callbacks);
+         ctx.verbose = opt_verbose;
+         ctx.pipeline = !opt_nopipe;
+         ctx.lines.debounce = opt_debounce / 1000.0;
+         if ((opt_capture) && (cap_open(opt_capture) < 0)) {
+              printf("Unable to create capture file (%s)\n", opt_capture);
+              exit(1);
+         }
+         if ((opt_trace) && (trace_open() < 0)) {
+              printf("Unable to allocate the trace buffer\n");
+              exit(1);
+         }
+         getkey = sim_getkey;
+         sim_rand = opt_seed;
+         for (i=0; i<keymap.nb; i++)
+             kd[i].timeout = -1;
+
+         keypressed = 0;
+         while (!quit) {
+              psp_step(&ctx);
+              quit = process_keyboard();
+         }
+
+         printf("Simulated %.3f s, %.1f frames/s acked\n", timestamp(), ctx.stats.acked / timestamp());
+         printf("Keys: %d, frames sent: %lu, acked: %lu, resent: %lu, received: %lu, duplicates: %lu\n",
+                nb_keys, ctx.stats.sent, ctx.stats.acked, ctx.stats.retries, ctx.stats.received, ctx.stats.duplicates);
+         printf("Bad frames: %lu (checksum: %lu, length: %lu, truncated: %lu), skipped: %lu, stray: %lu\n",
+                ctx.stats.bad_frames, ctx.stats.bad_checksum, ctx.stats.bad_length,
+                ctx.stats.truncated, ctx.stats.skipped, ctx.stats.stray);
+         printf("Collisions: %lu, RTS resent: %lu\n", ctx.stats.collisions, ctx.stats.rts_retries);
+         printf("Power glitches ignored: %lu, breaks: %lu, resets: %d\n",
+                ctx.lines.glitches, ctx.lines.breaks, nb_resets);
+         if (opt_verbose)
+         {
+             n = psp_lines_history(&ctx, history, PSP_LINE_HISTORY);
+             for (i=0; i<n; i++)
+                 printf("  [%3.3f] %-6s lines %03X\n", history[i].t,
+                        line_event[history[i].event], history[i].lines);
+         }
+         if (cap_file)
+             fclose(cap_file);
+         trace_close();
+         exit(ctx.stats.errors?1:0);
+     }
+
      if (argv[optind] != NULL)
      {
          strncpy (devname, argv[optind], NAME_SIZE);
          devname[NAME_SIZE-1] = 0;
      }
 
-     fd_serial = open(devname, O_RDWR | O_NOCTTY | O_NONBLOCK);
-     if (fd_serial < 0) {
+     psp_init(&ctx, NULL, &callbacks);
+     ctx.verbose = opt_verbose;
+     ctx.pipeline = !opt_nopipe;
+     ctx.lines.debounce = opt_debounce / 1000.0;
+     getkey = rt_getkey;
+     if (psp_open(&ctx, devname) < 0) {
           printf("\nUnable to open serial port (%s), are you root?\n", devname);
           ERR_EXIT;
      }
 
+     if ((opt_capture) && (cap_open(opt_capture) < 0)) {
+          printf("\nUnable to create capture file (%s)\n", opt_capture);
+          ERR_EXIT;
+     }
+
+     if ((opt_trace) && (trace_open() < 0)) {
+          printf("\nUnable to allocate the trace buffer\n");
+          ERR_EXIT;
+     }
+
      // Who wants a disclaimer?
      if (print_disclaimer())
          ERR_EXIT;
 
-     tcgetattr(fd_serial, &oldtty);  // save current port settings
-     bzero(&tty, sizeof(tty));       // Initialize the port settings structure to all zeros
-     tty.c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;      // 8N1
-     tty.c_iflag = IGNPAR;
-     tty.c_oflag = 0;
-     tty.c_lflag = 0;
-     tty.c_cc[VMIN] = 0;             // 0 means use-vtime
-     tty.c_cc[VTIME] = 1;            // time to wait until exiting read (tenths of a second)
-
-     tcflush(fd_serial, TCIFLUSH);   // flush old data and apply new settings
-     tcsetattr(fd_serial, TCSANOW, &tty); 
-     fcntl(fd_serial, F_SETOWN, getpid());    // enable our PID to receive serial interrupts
-     fcntl(fd_serial, F_SETFL, FASYNC);
-     
-     
-     saio.sa_handler = serial_handler;  // set the serial interrupt handler  
-     sigemptyset(&saio.sa_mask);        // clear existing settings
-     saio.sa_flags = 0;                 // make sure sa_flags is cleared
-     saio.sa_restorer = NULL;           // no restorer
-     sigaction(SIGIO, &saio, NULL);     // apply new settings
-
      // ncurses init
      init_screen();
 
-     // Set time origin (for timestamping)
-     gettimeofday(&tm, (struct timezone *)0);
-     t0 = (double)tm.tv_sec * 1.0 + (double)tm.tv_usec / 1000000.0;
-
      // Flag indicating that no key is pressed
      keypressed = 0;
    
      // main processing loop
      while (!quit) { 
-          // Update RS232 line status
-          check_status();
-          // Process inbound and outbound data
-          read_data();
-          write_data();
+          // Run the protocol engine (line status, inbound and outbound data)
+          psp_step(&ctx);
           // Process keyboard
           quit = process_keyboard();
      }
 
      // restore the old port settings before quitting
-     tcsetattr(fd_serial, TCSANOW, &oldtty); 
-     close(fd_serial);
+     psp_close(&ctx);
+     if (cap_file)
+         fclose(cap_file);
 
      // Quit ncurses mode
      endwin(); 
+     trace_close();
 
      exit(0);
 }
-
-
-/*
- *
- * serial_handler() : called whenever there is inboud data to process
- *
- */
-void serial_handler () {
-u8 temp_buffer[256];
-int len, i;
-
-    // Read the serial data into a temporary buffer
-    len = read(fd_serial, temp_buffer, sizeof(temp_buffer));
-
-    // Check that we have space to store it
-    if ((data_pos != data_end) && (len >= ((data_pos-data_end)&0xff)))
-    {   // We are not addressing overflow for now, just flagging them
-        printf("Overflow!\n");
-        overflow = -1;
-    }
-   
-    // Copy data into rotating buffer
-    for (i=0;i<len;i++)
-        data_buffer[data_end++] = temp_buffer[i];
-}
-
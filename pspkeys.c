@@ -0,0 +1,276 @@
+/*
+ * libpspremote : Serial remote protocol engine for Sony PSP
+ * version 1.00
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *
+ * Notes:
+ *
+ * Key binding profiles are text files, one binding per line:
+ *
+ *     # key   mask               label
+ *     p       PLAY               Play/Pause
+ *     +       VOLUP+VOLDOWN      Both volume keys
+ *     F5      0x0100|0x0200      Unknown pair
+ *
+ * A key is a single character, a code (0x1b, 27), SPACE, TAB, ENTER, or
+ * any name the client knows (F1, UP...). A mask is made of key names
+ * (PLAY, FFWD, REWIND, VOLUP, VOLDOWN, HOLD) and numbers, joined with '+'
+ * or '|'. Lines starting with '#' are comments (so '#' itself is 0x23).
+ * Esc (0x1b) quits the client, and cannot be bound.
+ *
+ * Profiles are compiled into a table indexed by key code, so that finding
+ * the binding for a key press takes a single lookup.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "pspremote.h"
+
+#define u8  unsigned char            // The usual supsect
+#define u16 unsigned short           // The usual supsect
+
+#define MAX_LINE    256
+
+// Names for the CMD_KEYS bits, and for the keys with no printable face
+static const struct {
+   const char* name;
+   int value;
+} mask_names[] = {
+   { "PLAY",    PSP_KEY_PLAY    },
+   { "FFWD",    PSP_KEY_FFWD    },
+   { "REWIND",  PSP_KEY_REWIND  },
+   { "VOLUP",   PSP_KEY_VOLUP   },
+   { "VOLDOWN", PSP_KEY_VOLDOWN },
+   { "HOLD",    PSP_KEY_HOLD    },
+}, key_names[] = {
+   { "SPACE",   ' '  },
+   { "TAB",     '\t' },
+   { "ENTER",   '\r' },
+};
+
+#define NB(table)  (sizeof(table)/sizeof(table[0]))
+
+
+/*
+ *
+ * psp_keymap_default(): the historical bindings, digit n sending bit n
+ *
+ */
+void psp_keymap_default(psp_keymap* km)
+{
+static const char* labels[] = {
+   "Play/Pause", "[0x0002]", "Fast Forward", "Rewind", "Vol +",
+   "Vol -", "[0x0040]", "Hold", "[0x0100]", "[0x0200]"
+};
+char name[2];
+int i;
+
+     memset(km, 0, sizeof(*km));
+     for (i=0; i<10; i++)
+     {
+         name[0] = '0'+i;
+         name[1] = 0;
+         psp_keymap_bind(km, '0'+i, 1<<i, name, labels[i]);
+     }
+}
+
+
+/*
+ *
+ * psp_keymap_bind(): add a binding. Returns -1 (and says why in
+ * km->error) if it cannot be added
+ *
+ */
+int psp_keymap_bind(psp_keymap* km, int key, u16 mask, const char* name, const char* label)
+{
+psp_binding* b;
+
+     if ((key < 0) || (key >= PSP_KEYMAP_KEYS))
+     {
+         snprintf(km->error, sizeof(km->error), "key code %d out of range", key);
+         return -1;
+     }
+     if (key == PSP_KEYMAP_QUIT)
+     {
+         snprintf(km->error, sizeof(km->error), "key %s is reserved to quit", name);
+         return -1;
+     }
+     if (km->slot[key])
+     {
+         snprintf(km->error, sizeof(km->error), "key %s bound twice", name);
+         return -1;
+     }
+     if (km->nb >= PSP_KEYMAP_BINDINGS)
+     {
+         snprintf(km->error, sizeof(km->error), "more than %d bindings", PSP_KEYMAP_BINDINGS);
+         return -1;
+     }
+
+     b = &km->bindings[km->nb++];
+     b->key = key;
+     b->mask = mask;
+     snprintf(b->name, sizeof(b->name), "%s", name);
+     snprintf(b->label, sizeof(b->label), "%s", label);
+     km->slot[key] = km->nb;
+     return 0;
+}
+
+
+// Key code for a name from a profile, -1 if unknown
+static int parse_key(const char* s, psp_keyname_fn keyname)
+{
+char* end;
+long v;
+int i;
+
+     if (s[1] == 0)
+         return (u8)s[0];
+     if (isdigit((u8)s[0]))
+     {
+         v = strtol(s, &end, 0);
+         return (*end)?-1:v;
+     }
+     for (i=0; i<NB(key_names); i++)
+         if (strcasecmp(s, key_names[i].name) == 0)
+             return key_names[i].value;
+     return (keyname)?keyname(s):-1;
+}
+
+// Mask for an expression from a profile, -1 if invalid
+static int parse_mask(const char* s)
+{
+char term[32];
+char* end;
+int mask = 0;
+int len, i;
+long v;
+
+     while (*s)
+     {
+         len = strcspn(s, "+|");
+         if ((len == 0) || (len >= sizeof(term)))
+             return -1;
+         memcpy(term, s, len);
+         term[len] = 0;
+         s += len;
+         if ((*s) && (*++s == 0))
+             return -1;              // Nothing after the last '+'
+
+         if (isdigit((u8)term[0]))
+         {
+             v = strtol(term, &end, 0);
+             if ((*end) || (v < 0) || (v > 0xffff))
+                 return -1;
+             mask |= v;
+             continue;
+         }
+         for (i=0; i<NB(mask_names); i++)
+             if (strcasecmp(term, mask_names[i].name) == 0)
+                 break;
+         if (i == NB(mask_names))
+             return -1;
+         mask |= mask_names[i].value;
+     }
+     return mask;
+}
+
+
+/*
+ *
+ * psp_keymap_load(): compile a profile. km is left untouched if the
+ * profile has errors, in which case -1 is returned and km->error says
+ * what is wrong
+ *
+ */
+int psp_keymap_load(psp_keymap* km, const char* filename, psp_keyname_fn keyname)
+{
+psp_keymap tmp;
+char line[MAX_LINE];
+char *key, *mask, *label, *save;
+FILE* f;
+int n = 0;
+int code, bits;
+
+     memset(&tmp, 0, sizeof(tmp));
+     f = fopen(filename, "r");
+     if (f == NULL)
+     {
+         snprintf(km->error, sizeof(km->error), "%s: cannot open", filename);
+         return -1;
+     }
+
+     while (fgets(line, sizeof(line), f))
+     {
+         n++;
+         key = strtok_r(line, " \t\r\n", &save);
+         if ((key == NULL) || (key[0] == '#'))
+             continue;
+         mask = strtok_r(NULL, " \t\r\n", &save);
+         label = strtok_r(NULL, "\r\n", &save);
+         while ((label) && ((*label == ' ') || (*label == '\t')))
+             label++;
+         if ((label == NULL) || (*label == 0))
+             label = mask;
+
+         if (mask == NULL)
+         {
+             snprintf(km->error, sizeof(km->error), "%s:%d: no mask for key %s", filename, n, key);
+             goto fail;
+         }
+         if ((code = parse_key(key, keyname)) < 0)
+         {
+             snprintf(km->error, sizeof(km->error), "%s:%d: unknown key %s", filename, n, key);
+             goto fail;
+         }
+         if ((bits = parse_mask(mask)) < 0)
+         {
+             snprintf(km->error, sizeof(km->error), "%s:%d: bad mask %s", filename, n, mask);
+             goto fail;
+         }
+         if (psp_keymap_bind(&tmp, code, bits, key, label) < 0)
+         {
+             snprintf(km->error, sizeof(km->error), "%s:%d: %.60s", filename, n, tmp.error);
+             goto fail;
+         }
+     }
+     fclose(f);
+
+     if (tmp.nb == 0)
+     {
+         snprintf(km->error, sizeof(km->error), "%s: no bindings", filename);
+         return -1;
+     }
+     *km = tmp;
+     return 0;
+
+fail:
+     fclose(f);
+     return -1;
+}
+
+
+/*
+ *
+ * psp_keymap_find(): binding for a key code, NULL if none
+ *
+ */
+const psp_binding* psp_keymap_find(const psp_keymap* km, int key)
+{
+     if ((key < 0) || (key >= PSP_KEYMAP_KEYS) || (km->slot[key] == 0))
+         return NULL;
+     return &km->bindings[km->slot[key]-1];
+}
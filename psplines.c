@@ -0,0 +1,243 @@
+/*
+ * libpspremote : Serial remote protocol engine for Sony PSP
+ * version 1.00
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *
+ * Notes:
+ *
+ * The PSP powers the remote through RS232_CTS, which is known to bounce
+ * when the cable moves. A change of CTS only counts once it has held for
+ * the debounce window, so that a glitch doesn't throw the session away.
+ * On a real port, a thread sleeps in TIOCMIWAIT instead of the engine
+ * polling TIOCMGET on every pass. To stop it, it is sent WAKEUP, whose
+ * handler does nothing but get it out of the ioctl.
+ *
+ */
+
+#define _GNU_SOURCE                  // pthread_timedjoin_np
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>            // serial_icounter_struct
+#include "pspremote.h"
+
+#define MONITORED   (TIOCM_CTS | TIOCM_DSR | TIOCM_CD | TIOCM_RNG)
+#define WAKEUP      SIGUSR2          // Interrupts TIOCMIWAIT when stopping
+#define RETRY       0.1              // Wait before TIOCMIWAIT again, after an error (s)
+#define STOP_WAIT   10000000         // Time the thread gets to stop before another WAKEUP (ns)
+
+
+// Add an event to the history ring
+static void record(psp_lines* l, double t, int event, int lines)
+{
+psp_line_event* e;
+
+     pthread_mutex_lock(&l->lock);
+     e = &l->history[l->head & (PSP_LINE_HISTORY-1)];
+     e->t = t;
+     e->event = event;
+     e->lines = lines;
+     l->head++;
+     pthread_mutex_unlock(&l->lock);
+}
+
+
+/*
+ *
+ * psp_lines_update(): feed the raw line status read at time now
+ *
+ */
+void psp_lines_update(psp_lines* l, int raw, double now)
+{
+     if (raw != l->raw)
+     {
+         record(l, now, PSP_LINE_EDGE, raw);
+         if ((raw ^ l->raw) & TIOCM_CTS)
+         {
+             // Back where it was before the window was over => glitch
+             if (((raw ^ l->stable) & TIOCM_CTS) == 0)
+             {
+                 __atomic_add_fetch(&l->glitches, 1, __ATOMIC_RELEASE);
+                 record(l, now, PSP_LINE_GLITCH, raw);
+             }
+             l->raw_t = now;
+         }
+         l->raw = raw;
+     }
+
+     if ((raw ^ l->stable) & TIOCM_CTS)
+     {
+         if (now - l->raw_t < l->debounce)
+             return;
+         record(l, now, (raw & TIOCM_CTS)?PSP_LINE_UP:PSP_LINE_DOWN, raw);
+     }
+     __atomic_store_n(&l->stable, raw, __ATOMIC_RELEASE);
+}
+
+
+/*
+ *
+ * psp_lines_break(): a break condition was seen on the receive line
+ *
+ */
+void psp_lines_break(psp_lines* l, double now)
+{
+     __atomic_add_fetch(&l->breaks, 1, __ATOMIC_RELEASE);
+     record(l, now, PSP_LINE_BREAK, l->raw);
+}
+
+
+// Sleep for a number of seconds (a cancellation point)
+static void doze(double t)
+{
+struct timespec ts;
+
+     ts.tv_sec = (time_t)t;
+     ts.tv_nsec = (long)((t - ts.tv_sec) * 1000000000.0);
+     nanosleep(&ts, NULL);
+}
+
+// Only there for TIOCMIWAIT to return EINTR
+static void wakeup(int sig)
+{
+}
+
+// The monitor thread
+static void* monitor(void* arg)
+{
+psp_ctx* ctx = arg;
+psp_lines* l = &ctx->lines;
+struct serial_icounter_struct ic;
+int counted, cts = 0;
+int raw;
+double now;
+
+     counted = (ioctl(ctx->fd, TIOCGICOUNT, &ic) == 0);
+     if (counted)
+         cts = ic.cts;
+
+     while (!__atomic_load_n(&l->stop, __ATOMIC_ACQUIRE))
+     {
+         raw = 0;
+         ioctl(ctx->fd, TIOCMGET, &raw);
+         now = psp_time(ctx);
+         // CTS went there and back since we last looked => still an edge
+         if ((counted) && (ioctl(ctx->fd, TIOCGICOUNT, &ic) == 0))
+         {
+             if ((ic.cts != cts) && (((raw ^ l->raw) & TIOCM_CTS) == 0))
+                 psp_lines_update(l, raw ^ TIOCM_CTS, now);
+             cts = ic.cts;
+         }
+         psp_lines_update(l, raw, now);
+
+         if ((raw ^ l->stable) & TIOCM_CTS)
+         {   // Check again once the window is over
+             doze(l->raw_t + l->debounce - now);
+             continue;
+         }
+
+         // Nothing pending => sleep until the lines change
+         if (ioctl(ctx->fd, TIOCMIWAIT, MONITORED) == 0)
+             continue;
+         if ((errno == ENOTTY) || (errno == EINVAL))
+         {   // Not supported by the driver => let the engine poll
+             __atomic_store_n(&l->threaded, 0, __ATOMIC_RELEASE);
+             return NULL;
+         }
+         if (errno != EINTR)
+             doze(RETRY);            // EIO and the like => try again in a while
+     }
+     return NULL;
+}
+
+
+/*
+ *
+ * psp_lines_start(): have a thread monitor the modem lines of the port
+ *                    (takes over the handler of WAKEUP)
+ *
+ */
+int psp_lines_start(psp_ctx* ctx)
+{
+struct sigaction sa;
+
+     // No SA_RESTART, so that the ioctl gets interrupted
+     memset(&sa, 0, sizeof(sa));
+     sa.sa_handler = wakeup;
+     sigemptyset(&sa.sa_mask);
+     sigaction(WAKEUP, &sa, NULL);
+
+     ctx->lines.stop = 0;
+     ctx->lines.threaded = 1;
+     if (pthread_create(&ctx->lines.thread, NULL, monitor, ctx) != 0)
+     {
+         ctx->lines.threaded = 0;
+         return -1;
+     }
+     ctx->lines.started = 1;
+     return 0;
+}
+
+
+/*
+ *
+ * psp_lines_stop(): stop the monitor thread, if any
+ *
+ */
+void psp_lines_stop(psp_ctx* ctx)
+{
+struct timespec ts;
+
+     if (!ctx->lines.started)
+         return;
+     __atomic_store_n(&ctx->lines.stop, 1, __ATOMIC_RELEASE);
+     // WAKEUP may land just before the thread blocks => keep at it
+     do {
+         pthread_kill(ctx->lines.thread, WAKEUP);
+         clock_gettime(CLOCK_REALTIME, &ts);
+         ts.tv_nsec += STOP_WAIT;
+         if (ts.tv_nsec >= 1000000000)
+         {
+             ts.tv_sec++;
+             ts.tv_nsec -= 1000000000;
+         }
+     } while (pthread_timedjoin_np(ctx->lines.thread, NULL, &ts) == ETIMEDOUT);
+     ctx->lines.started = 0;
+     ctx->lines.threaded = 0;
+}
+
+
+/*
+ *
+ * psp_lines_history(): copy the last line events, oldest first. Returns
+ * how many were copied
+ *
+ */
+int psp_lines_history(psp_ctx* ctx, psp_line_event* events, int max)
+{
+psp_lines* l = &ctx->lines;
+unsigned long first;
+int n;
+
+     pthread_mutex_lock(&l->lock);
+     n = (l->head < PSP_LINE_HISTORY)?l->head:PSP_LINE_HISTORY;
+     if (n > max)
+         n = max;
+     for (first = l->head - n; first != l->head; first++)
+         *events++ = l->history[first & (PSP_LINE_HISTORY-1)];
+     pthread_mutex_unlock(&l->lock);
+     return n;
+}
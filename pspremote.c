@@ -0,0 +1,944 @@
+/*
+ * libpspremote : Serial remote protocol engine for Sony PSP
+ * version 1.00
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *
+ * Notes:
+ *
+ * Most of the code below is based on the information provided by
+ * Marcus Comstedt et al. at: http://mc.pp.se/psp/phones.xhtml and
+ * http://forums.ps2dev.org/viewtopic.php?t=986
+ *
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/time.h>
+#include <termios.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>               // serial line status
+#include "pspremote.h"
+
+#define u8  unsigned char            // The usual supsect
+#define u16 unsigned short           // The usual supsect
+
+#define BAUDRATE    B4800            // baud rate the device spits out at
+
+// Logging, through the client's callback
+#define PERR(args...)                { psp_log(ctx, PSP_LOG_ERR, ## args); }
+#define PLOG(args...)                { psp_log(ctx, PSP_LOG_INFO, ## args); }
+#define PVERB(args...)               { psp_log(ctx, PSP_LOG_VERBOSE, ## args); }
+
+// Tracing, when the client asked for it
+#define TNOW                         ((ctx->trace)?psp_time(ctx):0)
+#define TSPAN(tid, name, detail, arg, start) { if (ctx->trace) psp_trace_span(ctx->trace, tid, name, detail, arg, start, psp_time(ctx)); }
+#define TEVENT(tid, name, detail, arg) { if (ctx->trace) psp_trace_instant(ctx->trace, tid, name, detail, arg, psp_time(ctx)); }
+
+
+// Count errors, and pass the message to the client
+static void psp_log(psp_ctx* ctx, int level, const char* fmt, ...)
+{
+va_list ap;
+
+    if (level == PSP_LOG_ERR)
+        ctx->stats.errors++;
+    if ((level == PSP_LOG_VERBOSE) && (!ctx->verbose))
+        return;
+    if (ctx->cb.log == NULL)
+        return;
+    va_start(ap, fmt);
+    vsnprintf(ctx->msg, sizeof(ctx->msg), fmt, ap);
+    va_end(ap);
+    ctx->cb.log(ctx->cb.user, level, ctx->msg);
+}
+
+// Change the processing state and let the client know
+static void set_state(psp_ctx* ctx, int state)
+{
+int old = ctx->state;
+
+    ctx->state = state;
+    if ((old != state) && (ctx->cb.state))
+        ctx->cb.state(ctx->cb.user, old, state);
+}
+
+
+/*
+ *
+ * Real I/O: serial port and wall clock
+ *
+ */
+static double rt_now(void* user)
+{
+psp_ctx* ctx = user;
+struct timeval t;
+     gettimeofday(&t, (struct timezone *)0);
+     return t.tv_sec * 1.0 + (double)t.tv_usec / 1000000.0 - ctx->t0;
+}
+
+static int rt_send(void* user, const u8* buf, int len)
+{
+     return write(((psp_ctx*)user)->fd, buf, len);
+}
+
+// With PARMRK, a break comes in as FF 00 00 and a genuine FF as FF FF
+static int rt_recv(void* user, u8* buf, int len)
+{
+psp_ctx* ctx = user;
+int r, i, n = 0;
+
+     r = read(ctx->fd, buf, len);
+     for (i=0; i<r; i++)
+     {
+         switch (ctx->rx_esc)
+         {
+             case 0:
+                 if (buf[i] == 0xff)
+                     ctx->rx_esc = 1;
+                 else
+                     buf[n++] = buf[i];
+                 break;
+             case 1:
+                 ctx->rx_esc = (buf[i] == 0x00)?2:0;
+                 if (buf[i] != 0x00)
+                     buf[n++] = buf[i];
+                 break;
+             case 2:
+                 ctx->rx_esc = 0;
+                 if (buf[i] == 0x00)
+                 {
+                     ctx->rx_break = n+1;
+                     psp_lines_break(&ctx->lines, rt_now(ctx));
+                 }
+                 break;
+         }
+     }
+     return n;
+}
+
+static int rt_lines(void* user)
+{
+int serial_status = 0;
+     ioctl(((psp_ctx*)user)->fd, TIOCMGET, &serial_status);
+     return serial_status;
+}
+
+static void rt_flush(void* user)
+{
+     tcflush(((psp_ctx*)user)->fd, TCIFLUSH);
+}
+
+
+/*
+ *
+ * psp_init(): set up a session. io may be NULL if psp_open() is to be used
+ *
+ */
+void psp_init(psp_ctx* ctx, const psp_io* io, const psp_callbacks* cb)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->fd = -1;
+    ctx->lines.debounce = PSP_DEBOUNCE;
+    ctx->tx_slot = -1;
+    ctx->pipeline = 1;
+    pthread_mutex_init(&ctx->lines.lock, NULL);
+    if (io)
+        ctx->io = *io;
+    if (cb)
+        ctx->cb = *cb;
+}
+
+
+/*
+ *
+ * psp_open(): open and configure the serial port, and use it for I/O
+ *
+ */
+int psp_open(psp_ctx* ctx, const char* devname)
+{
+struct timeval tm;
+struct termios tty;             // will be used for new port settings
+
+     ctx->fd = open(devname, O_RDWR | O_NOCTTY | O_NONBLOCK);
+     if (ctx->fd < 0)
+          return -1;
+
+     tcgetattr(ctx->fd, &ctx->oldtty);  // save current port settings
+     memset(&tty, 0, sizeof(tty));      // Initialize the port settings structure to all zeros
+     tty.c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;      // 8N1
+     tty.c_iflag = IGNPAR | PARMRK;  // report breaks in-band
+     tty.c_oflag = 0;
+     tty.c_lflag = 0;
+     tty.c_cc[VMIN] = 0;             // non blocking reads
+     tty.c_cc[VTIME] = 0;
+
+     tcflush(ctx->fd, TCIFLUSH);     // flush old data and apply new settings
+     tcsetattr(ctx->fd, TCSANOW, &tty);
+
+     ctx->io.user = ctx;
+     ctx->io.now = rt_now;
+     ctx->io.send = rt_send;
+     ctx->io.recv = rt_recv;
+     ctx->io.lines = rt_lines;
+     ctx->io.flush = rt_flush;
+
+     // Set time origin (for timestamping)
+     gettimeofday(&tm, (struct timezone *)0);
+     ctx->t0 = (double)tm.tv_sec * 1.0 + (double)tm.tv_usec / 1000000.0;
+
+     // Keep track of the PSP's power without polling, if the driver allows
+     psp_lines_start(ctx);
+
+     return 0;
+}
+
+
+/*
+ *
+ * psp_close(): restore the serial port settings and close it
+ *
+ */
+void psp_close(psp_ctx* ctx)
+{
+     if (ctx->fd < 0)
+         return;
+     psp_lines_stop(ctx);
+     tcsetattr(ctx->fd, TCSANOW, &ctx->oldtty);
+     close(ctx->fd);
+     ctx->fd = -1;
+}
+
+
+double psp_time(psp_ctx* ctx)
+{
+     return ctx->io.now(ctx->io.user);
+}
+
+
+// Known commands, with the size of their data
+static const struct {
+   u8 command;
+   int size;
+   const char* name;
+} cmd_info[] = {
+   { PSP_CMD_QUERY, 1, "CMD_QUERY" },
+   { PSP_CMD_INIT,  3, "CMD_INIT"  },
+   { PSP_CMD_ID,    4, "CMD_ID"    },
+   { PSP_CMD_KEYS,  2, "CMD_KEYS"  },
+};
+
+const char* psp_cmd_name(u8 command)
+{
+int i;
+     for (i=0; i<sizeof(cmd_info)/sizeof(cmd_info[0]); i++)
+         if (cmd_info[i].command == (command & 0xfe))
+             return cmd_info[i].name;
+     return "UNKNOWN";
+}
+
+// Expected data size for a command, -1 if we don't know it
+int psp_cmd_size(u8 command)
+{
+int i;
+     for (i=0; i<sizeof(cmd_info)/sizeof(cmd_info[0]); i++)
+         if (cmd_info[i].command == (command & 0xfe))
+             return cmd_info[i].size;
+     return -1;
+}
+
+
+/*
+ *
+ * psp_enqueue(): bufferize commands to send into a rotating command buffer
+ *
+ */
+int psp_enqueue(psp_ctx* ctx, u8 command, const u8* data, int size)
+{
+psp_cmd* cmd = &ctx->cmd_table[ctx->cmd_end];
+
+    if ((size < 0) || (size > PSP_MAX_BYTES))
+    {
+        PERR("Command %02X: invalid size %d", command, size);
+        return 1;
+    }
+    if (((ctx->cmd_end+1) & (PSP_QUEUE_SIZE-1)) == ctx->cmd_pos)
+    {
+        PERR("Command %02X: queue full", command);
+        return 1;
+    }
+
+    cmd->command = command;
+    cmd->size = size;
+    memcpy(cmd->data, data, size);
+
+    // Rotating buffer
+    ctx->cmd_end = (ctx->cmd_end+1) & (PSP_QUEUE_SIZE-1);
+
+    return 0;
+}
+
+
+/*
+ *
+ * psp_queued(): number of commands waiting to be sent (or acknowledged)
+ *
+ */
+int psp_queued(psp_ctx* ctx)
+{
+     return (ctx->cmd_end - ctx->cmd_pos) & (PSP_QUEUE_SIZE-1);
+}
+
+
+/*
+ *
+ * psp_set_keys(): report the remote keys that are held down. When two
+ * key states are already waiting behind the frame going out, the first
+ * is kept, so that a quick press isn't lost, and the new state replaces
+ * the second, so that the queue never fills up with them
+ *
+ */
+int psp_set_keys(psp_ctx* ctx, u16 mask)
+{
+int last = (ctx->cmd_end-1) & (PSP_QUEUE_SIZE-1);
+int prev = (ctx->cmd_end-2) & (PSP_QUEUE_SIZE-1);
+u8 data[2];
+
+    data[0] = (u8)mask;
+    data[1] = (u8)(mask>>8);
+    if ((psp_queued(ctx) >= 3) && (last != ctx->tx_slot) &&
+        (ctx->cmd_table[last].command == PSP_CMD_KEYS) && (ctx->cmd_table[prev].command == PSP_CMD_KEYS))
+    {
+        memcpy(ctx->cmd_table[last].data, data, 2);
+        return 0;
+    }
+    return psp_enqueue(ctx, PSP_CMD_KEYS, data, 2);
+}
+
+
+/*
+ *
+ * check_status(): Monitor serial port status
+ *
+ */
+static int check_status(psp_ctx* ctx)
+{
+static const u8 init_data[] = { 0x01, 0x01, 0x01 };
+static const u8 id_data[] = { 0x01, 0xA8, 0x00, 0x47 };
+int serial_status;
+int old_state = ctx->state;
+unsigned long seen;
+double t = TNOW;
+
+    // Clear RESET flag if set
+    if (ctx->state & PSP_STATE_RESET)
+        set_state(ctx, ctx->state & ~PSP_STATE_RESET);
+
+    // Check for any change of RS232_CTS, to indicate whether the device is powered.
+    // Short glitches are filtered out, see psplines.c
+    if (!__atomic_load_n(&ctx->lines.threaded, __ATOMIC_ACQUIRE))
+        psp_lines_update(&ctx->lines, ctx->io.lines(ctx->io.user), psp_time(ctx));
+    serial_status = __atomic_load_n(&ctx->lines.stable, __ATOMIC_ACQUIRE);
+    seen = __atomic_load_n(&ctx->lines.glitches, __ATOMIC_ACQUIRE);
+    if (ctx->glitches_seen != seen)
+    {
+        ctx->glitches_seen = seen;
+        PLOG("Ignored a glitch on RS232_CTS");
+        TEVENT(PSP_TRACE_LINES, "glitch", NULL, -1);
+    }
+    if (serial_status & TIOCM_CTS)
+    {   // RS323_CTS is on
+        if (!(ctx->state & PSP_STATE_ONLINE))
+        {   // We just went back on
+            set_state(ctx, PSP_STATE_ONLINE | PSP_STATE_RESET);
+
+            // Reset data buffer
+            ctx->data_pos = 0;
+            ctx->data_end = 0;
+            ctx->frame_deadline = 0;
+            ctx->ack_deadline = 0;
+            ctx->rts_deadline = 0;
+            ctx->cts_deadline = 0;
+            ctx->inbound_valid = 0;
+
+            // Reset command buffer
+            ctx->cmd_pos = 0;
+            ctx->cmd_end = 0;
+            ctx->tx_slot = -1;
+
+            // Enqueue init commands
+            psp_enqueue(ctx, PSP_CMD_INIT, init_data, sizeof(init_data));
+            psp_enqueue(ctx, PSP_CMD_ID, id_data, sizeof(id_data));
+        }
+    }
+    else
+    {   // RS232_CTS is off => PSP has cut serial line power
+        if (ctx->state & PSP_STATE_ONLINE)
+        {   // We just went offline
+            ctx->io.flush(ctx->io.user);    // flush serial port
+        }
+        set_state(ctx, PSP_STATE_OFFLINE);
+    }
+
+    // A break cuts short whatever frame was coming in, see read_frame()
+    seen = __atomic_load_n(&ctx->lines.breaks, __ATOMIC_ACQUIRE);
+    if (ctx->breaks_seen != seen)
+    {
+        ctx->breaks_seen = seen;
+        PERR("Break on the line");
+        TEVENT(PSP_TRACE_LINES, "break", NULL, -1);
+    }
+
+    // Only worth a span when the PSP came or went
+    if ((old_state ^ ctx->state) & PSP_STATE_ONLINE)
+        TSPAN(PSP_TRACE_LINES, "check_status", (ctx->state & PSP_STATE_ONLINE)?"online":"offline", -1, t);
+
+    return 0;
+}
+
+
+/*
+ *
+ * poll_input(): move inbound serial data into the rotating buffer
+ *
+ */
+static void poll_input(psp_ctx* ctx)
+{
+u8 temp_buffer[256];
+int len, i;
+
+    // Only read what we have room for
+    len = (ctx->data_pos - ctx->data_end - 1) & 0xff;
+    if (len == 0)
+    {   // We are not addressing overflow for now, just flagging them
+        ctx->overflow = -1;
+        return;
+    }
+
+    len = ctx->io.recv(ctx->io.user, temp_buffer, len);
+
+    // Remember where a break came in
+    if (ctx->rx_break)
+    {
+        ctx->break_pos = ctx->data_end + ctx->rx_break - 1;
+        ctx->break_pending = 1;
+        ctx->rx_break = 0;
+    }
+
+    // Copy data into rotating buffer
+    for (i=0;i<len;i++)
+        ctx->data_buffer[ctx->data_end++] = temp_buffer[i];
+}
+
+
+/*
+ *
+ * process_command: Process a verified inbound command from the PSP
+ *
+ */
+static int process_command(psp_ctx* ctx, u8 command, const u8* data, int size)
+{
+static const u8 no_keys[] = { 0x00, 0x00 };
+double t = TNOW;
+
+    ctx->inbound_phase = command & 0x01;
+    ctx->inbound_valid = 1;
+
+    if (ctx->cb.frame)
+        ctx->cb.frame(ctx->cb.user, PSP_DIR_IN, command, data, size);
+
+    switch(command & 0xfe)
+    {
+        case PSP_CMD_QUERY:
+            PLOG("Received CMD_QUERY: %02X", data[0]);
+            if (data[0] == 0x01)
+            {   // Only answer first time round
+                PLOG("enqueue CMD_KEYS");
+                psp_enqueue(ctx, PSP_CMD_KEYS, no_keys, sizeof(no_keys));
+            }
+            break;
+        default:
+            PLOG("Received UNKNOWN COMMAND %02X (%d bytes)", command, size);
+            break;
+    }
+    TSPAN(PSP_TRACE_ENGINE, "process_command", psp_cmd_name(command), command, t);
+    return 0;
+}
+
+
+/*
+ *
+ * resync: drop a bad frame and skip to the next FRAME_START, if any
+ *
+ */
+static void resync(psp_ctx* ctx, unsigned long* counter, const char* why)
+{
+u8 pos = ctx->data_pos;
+
+    ctx->stats.bad_frames++;
+    (*counter)++;
+    ctx->frame_deadline = 0;
+    PERR("Dropped inbound frame: %s", why);
+    TEVENT(PSP_TRACE_ENGINE, "resync", why, -1);
+
+    // Skip the FRAME_START we were on, then anything up to the next one
+    do {
+        pos++;
+        ctx->stats.skipped++;
+    } while ((pos != ctx->data_end) && (ctx->data_buffer[pos] != PSP_FRAME_START));
+    ctx->data_pos = pos;
+}
+
+
+/*
+ *
+ * read_frame: decode the frame at data_pos (on its FRAME_START), once it
+ * has come in completely. Returns 0 if we are still waiting for it
+ *
+ */
+#define AT(i)  ctx->data_buffer[(u8)(ctx->data_pos+(i))]
+
+static int read_frame(psp_ctx* ctx)
+{
+u8 frame[PSP_MAX_BYTES+2];      // command, data and checksum
+int avail = (u8)(ctx->data_end - ctx->data_pos);
+int size, len, i;
+u8 checksum;
+int cut = 0;
+
+    // Nothing past a break belongs to this frame
+    if (ctx->break_pending)
+    {
+        i = (u8)(ctx->break_pos - ctx->data_pos);
+        if ((i == 0) || (i > avail))
+            ctx->break_pending = 0;  // Already behind us
+        else
+            avail = cut = i;
+    }
+
+    size = (avail > 1)?psp_cmd_size(AT(1)):-1;
+    if (size >= 0)
+    {   // We know where the frame must end
+        len = size+2;
+        if (avail < len+2)
+            goto wait;
+        if (AT(len+1) != PSP_FRAME_STOP)
+        {
+            resync(ctx, &ctx->stats.bad_length, "no FRAME_STOP where expected");
+            return 1;
+        }
+    }
+    else
+    {   // Unknown command => FRAME_STOP ends it
+        for (len=0; ; len++)
+        {
+            if (len+2 > avail)
+                goto wait;
+            if (AT(len+1) == PSP_FRAME_STOP)
+                break;
+            if (AT(len+1) == PSP_FRAME_START)
+            {
+                resync(ctx, &ctx->stats.truncated, "interrupted by FRAME_START");
+                return 1;
+            }
+            if (len >= PSP_MAX_BYTES+2)
+            {
+                resync(ctx, &ctx->stats.bad_length, "too long");
+                return 1;
+            }
+        }
+        if (len < 2)
+        {
+            resync(ctx, &ctx->stats.bad_length, "too short");
+            return 1;
+        }
+    }
+
+    // Verify checksum: command ^ data ^ checksum must be 0
+    checksum = 0;
+    for (i=0; i<len; i++)
+    {
+        frame[i] = AT(i+1);
+        checksum ^= frame[i];
+    }
+    if (checksum != 0)
+    {
+        resync(ctx, &ctx->stats.bad_checksum, "bad checksum");
+        return 1;
+    }
+
+    ctx->frame_deadline = 0;
+    ctx->data_pos += len+2;
+    if ((ctx->inbound_valid) && ((frame[0] & 0x01) == ctx->inbound_phase))
+    {   // Same phase as the previous one => our ACK got lost, just ACK again
+        PLOG("Duplicate %s", psp_cmd_name(frame[0]));
+        ctx->stats.duplicates++;
+    }
+    else
+    {
+        ctx->stats.received++;
+        process_command(ctx, frame[0], &frame[1], len-2);
+    }
+
+    // Acknowledge
+    ctx->write_buffer[0] = PSP_FRAME_ACK0 | ctx->inbound_phase;
+    if (ctx->io.send(ctx->io.user, ctx->write_buffer, 1) != 1)
+        PERR("Error writing ACK");
+
+    ctx->rts_deadline = 0;
+    set_state(ctx, ctx->state & ~PSP_STATE_RTS);
+    return 1;
+
+wait:
+    if (cut)
+    {
+        ctx->break_pending = 0;
+        resync(ctx, &ctx->stats.truncated, "cut by a break");
+        return 1;
+    }
+    // Rest of data is not in yet. Give it a frame's time to show up
+    if (ctx->frame_deadline == 0)
+        ctx->frame_deadline = psp_time(ctx) + PSP_FRAME_TIMEOUT;
+    else if (psp_time(ctx) >= ctx->frame_deadline)
+    {
+        resync(ctx, &ctx->stats.truncated, "incomplete");
+        return 1;
+    }
+    return 0;
+}
+
+#undef AT
+
+
+/*
+ *
+ * read_data: incoming. Returns 0 once there is nothing more to process
+ *
+ */
+static int read_data(psp_ctx* ctx)
+{
+u8 frame;
+double t = TNOW;
+const char* what = "stray";
+
+    if (ctx->data_pos != ctx->data_end)
+    {
+       frame = ctx->data_buffer[ctx->data_pos];
+
+       // The PSP is sending a command
+       if (frame == PSP_FRAME_START)
+       {
+           if (!read_frame(ctx))
+               return 0;
+           TSPAN(PSP_TRACE_ENGINE, "read_data", "frame", -1, t);
+           return 1;
+       }
+
+       ctx->data_pos++;
+       switch(frame)
+       {
+           // We are receiving a Request To Send from the PSP => Send Clear To Send
+           case PSP_FRAME_RTS:
+               PLOG("Received: FRAME_RTS");
+               what = "RTS";
+               if (ctx->state & (PSP_STATE_ASKED | PSP_STATE_CTS))
+               {   // We both want the line => the PSP goes first, we ask again after
+                   PLOG("Collision: the PSP goes first");
+                   ctx->stats.collisions++;
+                   ctx->cts_deadline = 0;
+                   set_state(ctx, ctx->state & ~(PSP_STATE_ASKED | PSP_STATE_CTS));
+                   TEVENT(PSP_TRACE_ENGINE, "collision", NULL, -1);
+               }
+               set_state(ctx, ctx->state | PSP_STATE_RTS);
+               ctx->rts_deadline = psp_time(ctx) + PSP_RTS_TIMEOUT;
+               ctx->write_buffer[0] = PSP_FRAME_CTS;
+               if (ctx->io.send(ctx->io.user, ctx->write_buffer, 1) != 1)
+                   PERR("Error Sending CTS");
+               break;
+
+           // We are receiving CTS on a previous RTS we sent
+           case PSP_FRAME_CTS:
+               PLOG("Received: FRAME_CTS");
+               what = "CTS";
+               if (!(ctx->state & PSP_STATE_ASKED))
+               {   // Answer to an RTS we already got a CTS for
+                   PLOG("Stray FRAME_CTS");
+                   ctx->stats.stray++;
+                   break;
+               }
+               ctx->cts_deadline = 0;
+               set_state(ctx, (ctx->state | PSP_STATE_CTS) & ~PSP_STATE_ASKED);
+               break;
+
+           // The PSP is ack'ing a previous command we sent
+           case PSP_FRAME_ACK0:
+           case PSP_FRAME_ACK1:
+               PLOG("Received FRAME_ACK");
+               what = "ACK";
+               if (!(ctx->state & PSP_STATE_WAIT_ACK))
+               {
+                    PERR("Received ACK while not waiting for ACK!");
+                    break;
+               }
+               if ((frame & 0x01) != ctx->outbound_phase)
+               {   // Not for this frame => wait for the right one, or resend
+                   PERR("Phase read from PSP on ack does not match our outbound phase!");
+                   break;
+               }
+               ctx->stats.acked++;
+               ctx->ack_deadline = 0;
+               set_state(ctx, ctx->state & ~PSP_STATE_WAIT_ACK);
+               // Process next command
+               ctx->cmd_pos = (ctx->cmd_pos+1) & (PSP_QUEUE_SIZE-1);
+               // Toggle phase
+               ctx->outbound_phase = (ctx->outbound_phase)? 0:1;
+               break;
+
+           // The PSP is closing a frame we already dropped
+           case PSP_FRAME_STOP:
+               PLOG("Stray FRAME_STOP");
+               ctx->stats.stray++;
+               break;
+
+           // Who knows...
+           default:
+               PLOG("Unknown Frame: %02X", frame);
+               ctx->stats.stray++;
+               break;
+
+        }
+        TSPAN(PSP_TRACE_ENGINE, "read_data", what, frame, t);
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ *
+ * stage_frame: encode the frame for a queued command, ahead of its CTS
+ *
+ */
+static void stage_frame(psp_ctx* ctx, int slot, u8 phase)
+{
+psp_cmd* cmd = &ctx->cmd_table[slot];
+u8* tx_frame = ctx->tx_frame;
+u8 checksum;
+int len;
+int i;
+
+    if ((ctx->tx_slot == slot) && (ctx->tx_phase == phase))
+        return;                     // Already done
+
+    len = 0;
+    // Frame start delimiter
+    tx_frame[len++] = PSP_FRAME_START;
+    // We need to compute checksum too => init
+    checksum = cmd->command | phase;
+    // Write command
+    tx_frame[len++] = checksum;
+    // Write data
+    for (i=0; i<cmd->size; i++)
+    {
+        tx_frame[len] = cmd->data[i];
+        checksum ^= tx_frame[len++];
+    }
+    // Write checksum
+    tx_frame[len++] = checksum;
+    // Frame stop delimiter
+    tx_frame[len++] = PSP_FRAME_STOP;
+
+    ctx->tx_len = len;
+    ctx->tx_slot = slot;
+    ctx->tx_phase = phase;
+}
+
+
+/*
+ *
+ * ask_line: send RTS, unless we already did and are still waiting for CTS
+ *
+ */
+static int ask_line(psp_ctx* ctx, double t)
+{
+double now;
+
+    // The PSP has the line, or will soon
+    if (ctx->state & (PSP_STATE_RTS | PSP_STATE_CTS))
+        return 0;
+    if (ctx->state & PSP_STATE_ASKED)
+    {
+        if (psp_time(ctx) < ctx->cts_deadline)
+            return 0;
+        PLOG("No CTS - sending FRAME_RTS again");
+        ctx->stats.rts_retries++;
+    }
+
+    ctx->write_buffer[0] = PSP_FRAME_RTS;
+    if (ctx->io.send(ctx->io.user, ctx->write_buffer, 1) != 1)
+        PERR("Error sending RTS");
+    // The PSP only sees it once the frame ahead of it is out
+    now = psp_time(ctx);
+    ctx->cts_deadline = ((ctx->tx_free > now)?ctx->tx_free:now) + PSP_CTS_TIMEOUT;
+    set_state(ctx, ctx->state | PSP_STATE_ASKED);
+    TSPAN(PSP_TRACE_ENGINE, "write_data", "RTS", -1, t);
+    return 1;
+}
+
+
+/*
+ *
+ * write_data: outbound. The line is half-duplex as far as frames go: we
+ * need the PSP's CTS to send one, and the PSP goes first when both sides
+ * ask at once. ACK, RTS and CTS bytes can cross frames though, so we ask
+ * for the line for the next frame while the PSP is still acknowledging
+ * the current one
+ *
+ */
+static int write_data(psp_ctx* ctx)
+{
+psp_cmd* cmd = &ctx->cmd_table[ctx->cmd_pos];
+int next;
+double t = TNOW;
+
+   // Don't do anything if we're not online, or if there is nothing to send
+   if ((!(ctx->state & PSP_STATE_ONLINE)) || (ctx->cmd_pos == ctx->cmd_end))
+       return 0;
+
+   if (ctx->state & PSP_STATE_WAIT_ACK)
+   {   // Get the next frame ready, and the line for it
+       next = (ctx->cmd_pos+1) & (PSP_QUEUE_SIZE-1);
+       if ((!ctx->pipeline) || (next == ctx->cmd_end))
+           return 0;
+       stage_frame(ctx, next, ctx->outbound_phase ^ 1);
+       return ask_line(ctx, t);
+   }
+
+   // The PSP is in the process of sending us a frame
+   if (ctx->state & PSP_STATE_RTS)
+       return 0;
+
+   // Did we receive CTS from PSP yet?
+   if (!(ctx->state & PSP_STATE_CTS))
+       return ask_line(ctx, t);
+
+   // Send command
+   PLOG("Sending command %02X", cmd->command);
+   stage_frame(ctx, ctx->cmd_pos, ctx->outbound_phase);
+   if (ctx->io.send(ctx->io.user, ctx->tx_frame, ctx->tx_len) != ctx->tx_len)
+       PERR("Error writing frame");
+   ctx->stats.sent++;
+   ctx->tx_free = psp_time(ctx) + ctx->tx_len*PSP_BYTE_DELAY/1000000.0;
+   ctx->ack_deadline = psp_time(ctx) + PSP_ACK_TIMEOUT;
+   // The CTS is used up
+   ctx->cts_deadline = 0;
+   set_state(ctx, (ctx->state | PSP_STATE_WAIT_ACK) & ~(PSP_STATE_CTS | PSP_STATE_ASKED));
+
+   if (ctx->cb.frame)
+       ctx->cb.frame(ctx->cb.user, PSP_DIR_OUT, cmd->command, cmd->data, cmd->size);
+   TSPAN(PSP_TRACE_ENGINE, "write_data", psp_cmd_name(cmd->command), cmd->command, t);
+
+   // Ask for the line for the next one right behind it
+   write_data(ctx);
+   return 1;
+}
+
+
+/*
+ *
+ * psp_step(): run one pass of the protocol engine. Returns the new state
+ *
+ */
+int psp_step(psp_ctx* ctx)
+{
+     // Update RS232 line status
+     check_status(ctx);
+     // The PSP never acknowledged our last frame => send it again
+     if ((ctx->state & PSP_STATE_WAIT_ACK) && (psp_time(ctx) >= ctx->ack_deadline))
+     {
+         PERR("No ACK for command %02X - resending", ctx->cmd_table[ctx->cmd_pos].command);
+         ctx->stats.retries++;
+         TEVENT(PSP_TRACE_ENGINE, "ACK timeout", psp_cmd_name(ctx->cmd_table[ctx->cmd_pos].command), -1);
+         ctx->ack_deadline = 0;
+         // A CTS we already got for the next frame will do for this one
+         set_state(ctx, ctx->state & ~PSP_STATE_WAIT_ACK);
+     }
+     // The PSP never sent the frame it asked to send => stop holding off
+     if ((ctx->state & PSP_STATE_RTS) && (psp_time(ctx) >= ctx->rts_deadline))
+     {
+         PLOG("No frame after FRAME_RTS");
+         TEVENT(PSP_TRACE_ENGINE, "RTS timeout", NULL, -1);
+         ctx->rts_deadline = 0;
+         set_state(ctx, ctx->state & ~PSP_STATE_RTS);
+     }
+     // Process inbound and outbound data
+     poll_input(ctx);
+     while (read_data(ctx))
+         ;
+     write_data(ctx);
+     return ctx->state;
+}
+
+
+/*
+ *
+ * psp_busy(): whether the engine has work to do right away, as opposed to
+ * waiting for the PSP or for a new command
+ *
+ */
+int psp_busy(psp_ctx* ctx)
+{
+int next = (ctx->cmd_pos+1) & (PSP_QUEUE_SIZE-1);
+
+     // Inbound data that a step leaves behind is a frame still coming in
+     if ((ctx->data_pos != ctx->data_end) && (ctx->frame_deadline == 0))
+         return 1;
+     if (!(ctx->state & PSP_STATE_ONLINE) || (ctx->cmd_pos == ctx->cmd_end))
+         return 0;
+     // Same conditions as write_data() acting
+     if (ctx->state & PSP_STATE_WAIT_ACK)
+         return (ctx->pipeline) && (next != ctx->cmd_end) &&
+                (!(ctx->state & (PSP_STATE_RTS | PSP_STATE_CTS | PSP_STATE_ASKED)));
+     if (ctx->state & PSP_STATE_RTS)
+         return 0;
+     return (ctx->state & PSP_STATE_CTS) || (!(ctx->state & PSP_STATE_ASKED));
+}
+
+
+/*
+ *
+ * psp_deadline(): time at which the engine needs to run again even if
+ * nothing happens on the line (0 = none)
+ *
+ */
+double psp_deadline(psp_ctx* ctx)
+{
+double t = ctx->frame_deadline;
+double settle;
+
+     if ((ctx->state & PSP_STATE_WAIT_ACK) && ((t == 0) || (ctx->ack_deadline < t)))
+         t = ctx->ack_deadline;
+     if ((ctx->state & PSP_STATE_RTS) && ((t == 0) || (ctx->rts_deadline < t)))
+         t = ctx->rts_deadline;
+     if ((ctx->state & PSP_STATE_ASKED) && ((t == 0) || (ctx->cts_deadline < t)))
+         t = ctx->cts_deadline;
+     // A change of the lines we poll is waiting for its debounce window
+     if ((!ctx->lines.threaded) && ((ctx->lines.raw ^ ctx->lines.stable) & TIOCM_CTS))
+     {
+         settle = ctx->lines.raw_t + ctx->lines.debounce;
+         if ((t == 0) || (settle < t))
+             t = settle;
+     }
+     return t;
+}
@@ -0,0 +1,410 @@
+/*
+ * libpspremote : Serial remote protocol engine for Sony PSP
+ * version 1.00
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *
+ * Notes:
+ *
+ * The protocol engine never allocates memory and keeps no global state:
+ * all the state of a session lives in a psp_ctx (and psp_sim for the
+ * emulated PSP) provided by the caller. Only the helpers around it open
+ * files (key profiles, traces) or start a thread (the line monitor).
+ * A typical client does:
+ *
+ *     psp_ctx ctx;
+ *     psp_init(&ctx, NULL, &callbacks);
+ *     psp_open(&ctx, "/dev/ttyS0");
+ *     while (running) {
+ *         psp_step(&ctx);
+ *         ...
+ *         psp_set_keys(&ctx, PSP_KEY_PLAY);
+ *     }
+ *     psp_close(&ctx);
+ *
+ */
+
+#ifndef PSPREMOTE_H
+#define PSPREMOTE_H
+
+#include <stdint.h>
+#include <termios.h>
+#include <pthread.h>
+
+#define PSP_MAX_BYTES   10           // Maximum number of bytes per frame
+#define PSP_BYTE_DELAY  2084         // Time it takes to send one byte at 4800 bauds (in us)
+#define PSP_QUEUE_SIZE  16           // Size of the command queue (power of 2)
+#define PSP_FRAME_TIMEOUT 0.06       // Time allowed for a started inbound frame to complete (s)
+#define PSP_ACK_TIMEOUT 0.2          // Time after which an unacknowledged frame is resent (s)
+#define PSP_RTS_TIMEOUT 0.1          // Time after which we stop waiting for a frame we gave CTS to (s)
+#define PSP_CTS_TIMEOUT 0.02         // Time after which we ask again for a CTS that didn't come (s)
+
+// List of known PSP commands
+#define PSP_CMD_QUERY   0x02
+#define PSP_CMD_INIT    0x80
+#define PSP_CMD_ID      0x82
+#define PSP_CMD_KEYS    0x84
+
+// List of known PSP frame delimiters
+#define PSP_FRAME_RTS   0xf0         // Request To Send = "I want to speak"
+#define PSP_FRAME_CTS   0xf8         // Clear To Send = "Go ahead and speak"
+#define PSP_FRAME_START 0xfd         // Message begins
+#define PSP_FRAME_STOP  0xfe         // Message ends
+#define PSP_FRAME_ACK0  0xfa         // Message received ok (phase 0)
+#define PSP_FRAME_ACK1  0xfb         // Message received ok (phase 1)
+
+// Current processing state
+#define PSP_STATE_OFFLINE  0x00      // PSP is not powering up the serial port
+#define PSP_STATE_ONLINE   0x01      // PSP is powering serial port (2.5V on pin 5)
+#define PSP_STATE_RESET    0x02      // We just went back on
+#define PSP_STATE_RTS      0x04      // Request To Send has been received FROM the PSP
+#define PSP_STATE_CTS      0x08      // Clear To Send has been received FROM the PSP
+#define PSP_STATE_WAIT_ACK 0x10      // Pending ACK FROM the PSP (after message has been sent)
+#define PSP_STATE_ASKED    0x20      // Request To Send has been sent TO the PSP, no CTS yet
+
+// Remote keys, as sent in the CMD_KEYS mask
+#define PSP_KEY_PLAY    0x0001
+#define PSP_KEY_FFWD    0x0004
+#define PSP_KEY_REWIND  0x0008
+#define PSP_KEY_VOLUP   0x0010
+#define PSP_KEY_VOLDOWN 0x0020
+#define PSP_KEY_HOLD    0x0080
+
+// Key bindings
+#define PSP_KEYMAP_KEYS     512      // Key codes: characters, and ncurses' KEY_xxx (< 0777)
+#define PSP_KEYMAP_BINDINGS 20       // Bindings in a profile
+#define PSP_KEYMAP_QUIT     0x1b     // Esc quits the client, it can't be bound
+
+// Log levels
+#define PSP_LOG_INFO    0
+#define PSP_LOG_VERBOSE 1
+#define PSP_LOG_ERR     2
+
+// Frame directions
+#define PSP_DIR_IN      0            // From the PSP
+#define PSP_DIR_OUT     1            // To the PSP
+
+
+// Modem line monitor
+#define PSP_LINE_HISTORY  64         // Line events remembered (power of 2)
+#define PSP_DEBOUNCE      0.05       // Default time a change of CTS must hold for (s)
+
+// Line events
+#define PSP_LINE_EDGE     0          // Raw change of the modem lines
+#define PSP_LINE_UP       1          // CTS (PSP power) held on for the debounce window
+#define PSP_LINE_DOWN     2          // CTS held off for the debounce window
+#define PSP_LINE_GLITCH   3          // CTS went back before the window was over
+#define PSP_LINE_BREAK    4          // Break condition on the receive line
+
+
+// Everything the protocol engine needs from the outside world. The default
+// set (psp_open) drives a serial port with the wall clock; psp_sim_io()
+// provides an emulated PSP on a virtual clock.
+typedef struct {
+   void*  user;
+   double (*now)(void* user);                        // Seconds elapsed since the origin
+   int    (*send)(void* user, const uint8_t* buf, int len);
+   int    (*recv)(void* user, uint8_t* buf, int len);  // Non blocking, 0 if nothing
+   int    (*lines)(void* user);                      // Modem line status (TIOCM_xxx)
+   void   (*flush)(void* user);                      // Discard pending inbound data
+} psp_io;
+
+// Notifications to the client. Any of these can be NULL.
+typedef struct {
+   void*  user;
+   void   (*log)(void* user, int level, const char* msg);
+   void   (*state)(void* user, int old_state, int new_state);
+   void   (*frame)(void* user, int dir, uint8_t command, const uint8_t* data, int size);
+} psp_callbacks;
+
+// Definition of the commands we will enqueue
+typedef struct {
+   uint8_t command;
+   int     size;
+   uint8_t data[PSP_MAX_BYTES];
+} psp_cmd;
+
+// Session counters
+typedef struct {
+   unsigned long sent;               // Frames sent
+   unsigned long acked;              // Frames acknowledged by the PSP
+   unsigned long received;           // Frames received from the PSP
+   unsigned long duplicates;         // Frames received again because our ACK got lost
+   unsigned long errors;             // Errors logged
+   unsigned long retries;            // Frames resent for lack of ACK
+   unsigned long bad_frames;         // Inbound frames dropped (sum of the below)
+   unsigned long bad_checksum;       //   checksum mismatch
+   unsigned long bad_length;         //   wrong size for the command, or no FE where expected
+   unsigned long truncated;          //   interrupted by a new FD, or never completed
+   unsigned long skipped;            // Bytes discarded while resynchronizing
+   unsigned long stray;              // Unknown bytes outside of frames
+   unsigned long collisions;         // Both sides asked for the line => the PSP went first
+   unsigned long rts_retries;        // RTS sent again for lack of CTS
+} psp_stats;
+
+typedef struct {
+   double t;
+   int    event;                     // PSP_LINE_xxx
+   int    lines;                     // Raw modem lines (TIOCM_xxx) at that time
+} psp_line_event;
+
+// A key binding profile: which key sends which CMD_KEYS mask. A mask
+// with several bits set is a chord, sent in a single frame
+typedef struct {
+   int      key;                     // Key code
+   uint16_t mask;
+   char     name[12];                // Key, as written in the profile
+   char     label[24];
+} psp_binding;
+
+typedef struct {
+   psp_binding bindings[PSP_KEYMAP_BINDINGS];
+   int         nb;
+   uint8_t     slot[PSP_KEYMAP_KEYS];  // Key code -> binding+1 (0 = unbound)
+   char        error[80];            // Why psp_keymap_load() failed
+} psp_keymap;
+
+// Client lookup for the key names the library doesn't know (-1 = unknown)
+typedef int (*psp_keyname_fn)(const char* name);
+
+
+// Tracing: spans and instant events on a timeline, exported in the
+// Chrome trace-event format. The buffer is provided by the client, and
+// events are dropped once it is full
+#define PSP_TRACE_ENGINE  1          // Timeline rows (trace "threads")
+#define PSP_TRACE_CLIENT  2
+#define PSP_TRACE_LINES   3
+
+typedef struct {
+   double      t;                    // Start (s)
+   double      dur;                  // Duration of a span (s)
+   const char* name;                 // Static strings only
+   const char* detail;               // Optional (NULL)
+   int         arg;                  // Optional (-1)
+   int         tid;                  // PSP_TRACE_xxx
+   char        ph;                   // 'X' = span, 'i' = instant, 0 = being written
+} psp_trace_event;
+
+typedef struct {
+   psp_trace_event* events;
+   unsigned long    size;
+   unsigned long    head;            // Slots handed out so far
+   unsigned long    dropped;
+} psp_trace;
+
+
+// Debounced view of the modem lines. With a real serial port, a thread
+// blocked on TIOCMIWAIT keeps it up to date; otherwise (emulated PSP, or
+// a driver without TIOCMIWAIT) the engine polls io.lines() on each step.
+typedef struct {
+   double          debounce;         // Time a change of CTS must hold for (s)
+   int             threaded;         // Kept up to date by the monitor thread
+   int             started;          // The thread exists (it may have given up)
+   int             stop;             // Asks the thread to leave
+   pthread_t       thread;
+   pthread_mutex_t lock;             // Guards the history
+   int             raw;              // Last raw status, and when it changed
+   double          raw_t;
+   int             stable;           // Debounced status
+   unsigned long   glitches;         // CTS changes that did not last
+   unsigned long   breaks;           // Breaks detected on the receive line
+   psp_line_event  history[PSP_LINE_HISTORY];
+   unsigned long   head;             // Events recorded so far
+} psp_lines;
+
+// A protocol session. Treat as opaque: it is only exposed so that it can
+// be allocated by the caller.
+typedef struct {
+   psp_io        io;
+   psp_callbacks cb;
+   int           verbose;
+
+   // Serial port
+   int            fd;
+   struct termios oldtty;
+   double         t0;
+
+   // The command queue
+   psp_cmd  cmd_table[PSP_QUEUE_SIZE];
+   int      cmd_pos;
+   int      cmd_end;
+
+   // Buffer for sending data
+   uint8_t  write_buffer[PSP_MAX_BYTES+4];
+
+   // Outbound frame, encoded ahead of the CTS that lets it go
+   uint8_t  tx_frame[PSP_MAX_BYTES+4];
+   int      tx_len;
+   int      tx_slot;                 // Command it holds (-1 = none)
+   uint8_t  tx_phase;
+   double   tx_free;                 // The last frame we wrote is out on the line by then
+   int      pipeline;                // Ask for the line again while an ACK is in flight
+
+   // Rotating buffer for input
+   uint8_t  data_buffer[256];
+   uint8_t  data_pos;
+   uint8_t  data_end;
+   int      overflow;
+
+   // Current processing state
+   int      state;
+
+   // Sony's weird phase game
+   uint8_t  inbound_phase;
+   uint8_t  outbound_phase;
+   int      inbound_valid;           // inbound_phase holds the last frame we accepted
+
+   // Modem lines
+   psp_lines     lines;
+   unsigned long glitches_seen;
+   unsigned long breaks_seen;
+   int           rx_esc;             // PARMRK escape sequence in progress
+   int           rx_break;           // Break found by the last read (offset+1)
+   int           break_pending;      // A break sits at break_pos in data_buffer
+   uint8_t       break_pos;
+
+   // Timers
+   double   frame_deadline;          // Partial inbound frame gets dropped (0 = none)
+   double   ack_deadline;            // Outbound frame gets resent (0 = none)
+   double   rts_deadline;            // PSP's RTS gets forgotten (0 = none)
+   double   cts_deadline;            // Our RTS gets sent again (0 = none)
+
+   psp_stats  stats;
+   psp_trace* trace;                 // NULL when not tracing
+   char       msg[256];
+} psp_ctx;
+
+// Capture files (psp_remote -c, psp_analyze): PSP_CAP_MAGIC, then for each
+// read or write on the line a psp_cap_rec header followed by its len bytes.
+// Fields are in host byte order.
+#define PSP_CAP_MAGIC   "PSPCAP01"
+#define PSP_CAP_MAGIC_SIZE 8
+
+typedef struct {
+   uint32_t sec;                     // Time of the read/write since the origin
+   uint32_t usec;
+   uint16_t len;
+   uint8_t  dir;                     // PSP_DIR_IN or PSP_DIR_OUT
+   uint8_t  pad;
+} psp_cap_rec;
+
+
+/*
+ * Session
+ */
+void   psp_init(psp_ctx* ctx, const psp_io* io, const psp_callbacks* cb);
+int    psp_open(psp_ctx* ctx, const char* devname);
+void   psp_close(psp_ctx* ctx);
+int    psp_step(psp_ctx* ctx);
+int    psp_busy(psp_ctx* ctx);
+double psp_deadline(psp_ctx* ctx);
+double psp_time(psp_ctx* ctx);
+
+/*
+ * Modem lines
+ */
+void   psp_lines_update(psp_lines* l, int raw, double now);
+void   psp_lines_break(psp_lines* l, double now);
+int    psp_lines_start(psp_ctx* ctx);
+void   psp_lines_stop(psp_ctx* ctx);
+int    psp_lines_history(psp_ctx* ctx, psp_line_event* events, int max);
+
+/*
+ * Tracing
+ */
+void   psp_trace_init(psp_trace* tr, psp_trace_event* events, unsigned long size);
+void   psp_trace_span(psp_trace* tr, int tid, const char* name, const char* detail,
+                      int arg, double start, double end);
+void   psp_trace_instant(psp_trace* tr, int tid, const char* name, const char* detail,
+                         int arg, double t);
+int    psp_trace_save(psp_trace* tr, const char* filename);
+
+/*
+ * Commands
+ */
+int    psp_enqueue(psp_ctx* ctx, uint8_t command, const uint8_t* data, int size);
+int    psp_set_keys(psp_ctx* ctx, uint16_t mask);
+int    psp_queued(psp_ctx* ctx);
+
+/*
+ * Key bindings
+ */
+void   psp_keymap_default(psp_keymap* km);
+int    psp_keymap_bind(psp_keymap* km, int key, uint16_t mask, const char* name, const char* label);
+int    psp_keymap_load(psp_keymap* km, const char* filename, psp_keyname_fn keyname);
+const psp_binding* psp_keymap_find(const psp_keymap* km, int key);
+const char* psp_cmd_name(uint8_t command);
+int    psp_cmd_size(uint8_t command);
+
+
+/*
+ * Emulated PSP on a virtual clock. Time only moves when psp_sim_advance()
+ * is called, so that hours of protocol can run in a fraction of a second
+ * and always produce the same results.
+ */
+typedef unsigned long long psp_vtime;  // Virtual time (us)
+
+#define PSP_SIM_POWER_ON   100000    // Virtual time at which the PSP powers the port (us)
+#define PSP_SIM_LATENCY    1000      // PSP response latency (us)
+#define PSP_SIM_RTS_RETRY  20000     // PSP resends RTS if no CTS after this long (us)
+#define PSP_SIM_ACK_TIMEOUT 50000    // PSP resends its frame if no ACK after this long (us)
+#define PSP_SIM_QUERY      100000    // Delay between CMD_ID and the PSP's first CMD_QUERY (us)
+#define PSP_SIM_POLL       500000    // Delay between an acknowledged CMD_QUERY and the next one (us)
+
+typedef struct {
+   psp_vtime clock;
+   psp_vtime power_on;
+
+   // Bytes in flight from us to the PSP, with their arrival time
+   struct { psp_vtime t; uint8_t b; } tx[256];
+   uint8_t   tx_pos;
+   uint8_t   tx_end;
+   psp_vtime tx_free;                // Our TX line is busy until then
+
+   // Chunks in flight from the PSP to us, delivered when their last byte lands
+   struct { psp_vtime t; int len; uint8_t data[PSP_MAX_BYTES+3]; } rx[16];
+   int       rx_pos;
+   int       rx_end;
+   psp_vtime rx_free;                // Our RX line is busy until then
+
+   // Bytes delivered but not read yet (the serial driver's buffer)
+   uint8_t   in[256];
+   uint8_t   in_pos;
+   uint8_t   in_end;
+
+   // Emulated PSP
+   uint8_t   frame[PSP_MAX_BYTES+3]; // Frame being received from us
+   int       frame_len;              // -1 when not inside a frame
+   psp_vtime cts_given;              // When we were given CTS (0 = we owe no frame)
+   int       rts_sent;               // The PSP wants to speak
+   int       wait_ack;               // The PSP sent a frame and waits for our ACK
+   int       query;                  // A CMD_QUERY is pending
+   uint8_t   query_data;             // and what it carries
+   uint8_t   phase;                  // The PSP's outbound phase
+   int       in_phase;               // Phase of the last frame accepted from us (-1 = none)
+   psp_vtime timer;                  // Next RTS (re)transmission (0 = none)
+
+   // Line noise: probability for each byte, either way, to get a bit flipped
+   double       noise;
+   unsigned int seed;
+
+   // Power glitches: CTS drops for glitch_len every glitch_period (0 = never)
+   psp_vtime    glitch_period;
+   psp_vtime    glitch_len;
+} psp_sim;
+
+void      psp_sim_init(psp_sim* sim, psp_vtime power_on);
+void      psp_sim_io(psp_sim* sim, psp_io* io);
+void      psp_sim_advance(psp_sim* sim, psp_vtime t);
+psp_vtime psp_sim_next_event(psp_sim* sim);
+
+#endif
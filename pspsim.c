@@ -0,0 +1,339 @@
+/*
+ * libpspremote : Serial remote protocol engine for Sony PSP
+ * version 1.00
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *
+ * Notes:
+ *
+ * An emulated PSP on the other end of a virtual serial line. Virtual time
+ * only moves when the client calls psp_sim_advance(), so that a session
+ * always produces the same results.
+ *
+ */
+
+#include <string.h>
+#include <sys/ioctl.h>
+#include "pspremote.h"
+
+#define u8  unsigned char            // The usual supsect
+
+
+/*
+ *
+ * psp_sim_init(): a PSP that powers up the serial port at power_on
+ *
+ */
+void psp_sim_init(psp_sim* sim, psp_vtime power_on)
+{
+     memset(sim, 0, sizeof(*sim));
+     sim->power_on = power_on;
+     sim->frame_len = -1;
+     sim->in_phase = -1;
+}
+
+
+// Deterministic PRNG for the line noise
+static unsigned int sim_random(psp_sim* sim, unsigned int n)
+{
+     sim->seed = sim->seed * 1103515245 + 12345;
+     return (sim->seed >> 8) % n;
+}
+
+// What a byte looks like after going through the line
+static u8 sim_line(psp_sim* sim, u8 b)
+{
+     if ((sim->noise > 0) && (sim_random(sim, 1000000) < sim->noise*1000000))
+         b ^= 1 << sim_random(sim, 8);
+     return b;
+}
+
+// Queue data on the PSP -> us line
+static void sim_reply(psp_sim* sim, const u8* buf, int len, psp_vtime t)
+{
+int i;
+
+     if (((sim->rx_end+1) & 0x0f) == sim->rx_pos)
+         return;                     // The line is saturated => lost
+     if (t < sim->rx_free)
+         t = sim->rx_free;
+     sim->rx_free = t + len*PSP_BYTE_DELAY;
+     sim->rx[sim->rx_end].t = sim->rx_free;
+     sim->rx[sim->rx_end].len = len;
+     for (i=0; i<len; i++)
+         sim->rx[sim->rx_end].data[i] = sim_line(sim, buf[i]);
+     sim->rx_end = (sim->rx_end+1) & 0x0f;
+}
+
+// Have the PSP answer a complete frame from us
+static void sim_frame(psp_sim* sim, psp_vtime t)
+{
+u8 buf[1];
+u8 checksum = 0;
+int i;
+
+     for (i=0; i<sim->frame_len; i++)
+         checksum ^= sim->frame[i];
+     // Frames with a bad checksum are silently ignored
+     if ((sim->frame_len < 2) || (checksum != 0))
+         return;
+     buf[0] = PSP_FRAME_ACK0 | (sim->frame[0] & 0x01);
+     sim_reply(sim, buf, 1, t+PSP_SIM_LATENCY);
+     // A frame we already accepted is only acknowledged again
+     if ((sim->frame[0] & 0x01) == sim->in_phase)
+         return;
+     sim->in_phase = sim->frame[0] & 0x01;
+     // Once identified, the remote gets queried
+     if ((sim->frame[0] & 0xfe) == PSP_CMD_ID)
+     {
+         sim->query = 1;
+         sim->query_data = 0x01;
+         sim->timer = t+PSP_SIM_QUERY;
+     }
+}
+
+// Have the PSP process one byte from us
+static void sim_byte(psp_sim* sim, u8 b, psp_vtime t)
+{
+u8 buf[PSP_MAX_BYTES+3];
+int len;
+
+     if (sim->frame_len >= 0)
+     {
+         if (b == PSP_FRAME_START)
+             sim->frame_len = 0;
+         else if (b == PSP_FRAME_STOP)
+         {
+             sim_frame(sim, t);
+             sim->frame_len = -1;
+         }
+         else if (sim->frame_len < sizeof(sim->frame))
+             sim->frame[sim->frame_len++] = b;
+         else
+             sim->frame_len = -1;    // Lost FRAME_STOP => give up on it
+         return;
+     }
+
+     switch(b)
+     {
+         case PSP_FRAME_RTS:
+             // The PSP has priority => ignore our RTS while it wants to speak.
+             // Also ignore an RTS sent again before our CTS could arrive,
+             // unless our frame never came
+             if (sim->rts_sent)
+                 break;
+             if ((sim->cts_given) && (t < sim->cts_given + PSP_SIM_RTS_RETRY))
+                 break;
+             buf[0] = PSP_FRAME_CTS;
+             sim_reply(sim, buf, 1, t+PSP_SIM_LATENCY);
+             sim->cts_given = t;
+             break;
+         case PSP_FRAME_CTS:
+             if (!sim->rts_sent)
+                 break;
+             len = 0;
+             buf[len++] = PSP_FRAME_START;
+             buf[len++] = PSP_CMD_QUERY | sim->phase;
+             buf[len++] = sim->query_data;
+             buf[len++] = (PSP_CMD_QUERY | sim->phase) ^ sim->query_data;
+             buf[len++] = PSP_FRAME_STOP;
+             sim_reply(sim, buf, len, t+PSP_SIM_LATENCY);
+             sim->rts_sent = 0;
+             sim->wait_ack = 1;
+             sim->timer = t + PSP_SIM_ACK_TIMEOUT;
+             break;
+         case PSP_FRAME_ACK0:
+         case PSP_FRAME_ACK1:
+             if ((!sim->wait_ack) || ((b & 0x01) != sim->phase))
+                 break;
+             sim->phase ^= 0x01;
+             sim->wait_ack = 0;
+             // Then the remote keeps being polled
+             sim->query_data = 0x00;
+             sim->timer = t + PSP_SIM_POLL;
+             break;
+         case PSP_FRAME_START:
+             sim->frame_len = 0;
+             sim->cts_given = 0;
+             break;
+     }
+}
+
+// The PSP wants to (re)send its pending query, or poll the remote
+static void sim_timer(psp_sim* sim, psp_vtime t)
+{
+u8 buf[1];
+
+     sim->timer = 0;
+     if (!sim->query)
+         return;
+     sim->wait_ack = 0;
+     sim->rts_sent = 1;
+     buf[0] = PSP_FRAME_RTS;
+     sim_reply(sim, buf, 1, t);
+     sim->timer = t + PSP_SIM_RTS_RETRY;
+}
+
+
+// Where we are in the power glitch cycle, if glitching
+static psp_vtime sim_glitch_phase(psp_sim* sim)
+{
+     return (sim->clock - sim->power_on) % sim->glitch_period;
+}
+
+
+/*
+ *
+ * psp_sim_advance(): run every emulated event up to virtual time t
+ *
+ */
+void psp_sim_advance(psp_sim* sim, psp_vtime t)
+{
+psp_vtime next;
+int i;
+
+     for (;;)
+     {
+         next = t+1;
+         if (sim->tx_pos != sim->tx_end)
+             next = sim->tx[sim->tx_pos].t;
+         if ((sim->rx_pos != sim->rx_end) && (sim->rx[sim->rx_pos].t < next))
+             next = sim->rx[sim->rx_pos].t;
+         if ((sim->timer) && (sim->timer < next))
+             next = sim->timer;
+         if (next > t)
+             break;
+
+         sim->clock = next;
+         if ((sim->tx_pos != sim->tx_end) && (sim->tx[sim->tx_pos].t == next))
+         {
+             sim_byte(sim, sim->tx[sim->tx_pos].b, next);
+             sim->tx_pos++;
+         }
+         else if ((sim->rx_pos != sim->rx_end) && (sim->rx[sim->rx_pos].t == next))
+         {   // Lands in the serial driver's buffer
+             for (i=0; i<sim->rx[sim->rx_pos].len; i++)
+                 if ((u8)(sim->in_end+1) != sim->in_pos)
+                     sim->in[sim->in_end++] = sim->rx[sim->rx_pos].data[i];
+             sim->rx_pos = (sim->rx_pos+1) & 0x0f;
+         }
+         else
+             sim_timer(sim, next);
+     }
+     if (t > sim->clock)
+         sim->clock = t;
+}
+
+
+/*
+ *
+ * psp_sim_next_event(): virtual time of the next thing the PSP will do
+ *
+ */
+psp_vtime psp_sim_next_event(psp_sim* sim)
+{
+psp_vtime next = (psp_vtime)-1;
+psp_vtime t;
+
+     if (sim->in_pos != sim->in_end)
+         return sim->clock;
+     if ((sim->clock < sim->power_on) && (sim->power_on < next))
+         next = sim->power_on;
+     if ((sim->tx_pos != sim->tx_end) && (sim->tx[sim->tx_pos].t < next))
+         next = sim->tx[sim->tx_pos].t;
+     if ((sim->rx_pos != sim->rx_end) && (sim->rx[sim->rx_pos].t < next))
+         next = sim->rx[sim->rx_pos].t;
+     if ((sim->timer) && (sim->timer < next))
+         next = sim->timer;
+     // Either end of a power glitch
+     if ((sim->glitch_period) && (sim->clock >= sim->power_on))
+     {
+         t = sim_glitch_phase(sim);
+         t = (t < sim->glitch_period - sim->glitch_len)?
+             sim->glitch_period - sim->glitch_len - t : sim->glitch_period - t;
+         if (sim->clock + t < next)
+             next = sim->clock + t;
+     }
+     return next;
+}
+
+
+/*
+ *
+ * Simulated I/O
+ *
+ */
+static double sim_now(void* user)
+{
+     return ((psp_sim*)user)->clock / 1000000.0;
+}
+
+static int sim_send(void* user, const u8* buf, int len)
+{
+psp_sim* sim = user;
+int i;
+
+     for (i=0; i<len; i++)
+     {
+         if ((u8)(sim->tx_end+1) == sim->tx_pos)
+             return i;
+         if (sim->tx_free < sim->clock)
+             sim->tx_free = sim->clock;
+         sim->tx_free += PSP_BYTE_DELAY;
+         sim->tx[sim->tx_end].t = sim->tx_free;
+         sim->tx[sim->tx_end++].b = sim_line(sim, buf[i]);
+     }
+     return len;
+}
+
+static int sim_recv(void* user, u8* buf, int len)
+{
+psp_sim* sim = user;
+int i;
+
+     for (i=0; (i<len) && (sim->in_pos != sim->in_end); i++)
+         buf[i] = sim->in[sim->in_pos++];
+     return i;
+}
+
+static int sim_lines(void* user)
+{
+psp_sim* sim = user;
+     if (sim->clock < sim->power_on)
+         return 0;
+     // CTS drops for the last glitch_len of each glitch_period
+     if ((sim->glitch_period) && (sim_glitch_phase(sim) >= sim->glitch_period - sim->glitch_len))
+         return 0;
+     return TIOCM_CTS;
+}
+
+static void sim_flush(void* user)
+{
+psp_sim* sim = user;
+     sim->in_pos = sim->in_end;
+}
+
+
+/*
+ *
+ * psp_sim_io(): I/O table that talks to the emulated PSP
+ *
+ */
+void psp_sim_io(psp_sim* sim, psp_io* io)
+{
+     io->user = sim;
+     io->now = sim_now;
+     io->send = sim_send;
+     io->recv = sim_recv;
+     io->lines = sim_lines;
+     io->flush = sim_flush;
+}
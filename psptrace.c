@@ -0,0 +1,139 @@
+/*
+ * libpspremote : Serial remote protocol engine for Sony PSP
+ * version 1.00
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *
+ * Notes:
+ *
+ * A timeline of what the engine and its client are doing, to be opened
+ * in chrome://tracing or Perfetto. Recording an event only takes a slot
+ * with an atomic increment, so that it is cheap, and safe from the line
+ * monitor thread as well. Spans are stored once complete ('X' events),
+ * so a full buffer never leaves one half open.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pspremote.h"
+
+
+/*
+ *
+ * psp_trace_init(): record into a buffer of size events
+ *
+ */
+void psp_trace_init(psp_trace* tr, psp_trace_event* events, unsigned long size)
+{
+     memset(tr, 0, sizeof(*tr));
+     memset(events, 0, size*sizeof(*events));
+     tr->events = events;
+     tr->size = size;
+}
+
+
+// Take a slot, fill it, then publish it by setting its phase
+static void record(psp_trace* tr, char ph, int tid, const char* name, const char* detail,
+                   int arg, double t, double dur)
+{
+psp_trace_event* e;
+unsigned long i;
+
+     i = __atomic_fetch_add(&tr->head, 1, __ATOMIC_RELAXED);
+     if (i >= tr->size)
+     {
+         __atomic_add_fetch(&tr->dropped, 1, __ATOMIC_RELAXED);
+         return;
+     }
+     e = &tr->events[i];
+     e->t = t;
+     e->dur = dur;
+     e->name = name;
+     e->detail = detail;
+     e->arg = arg;
+     e->tid = tid;
+     __atomic_store_n(&e->ph, ph, __ATOMIC_RELEASE);
+}
+
+
+/*
+ *
+ * psp_trace_span(): something that ran from start to end
+ *
+ */
+void psp_trace_span(psp_trace* tr, int tid, const char* name, const char* detail,
+                    int arg, double start, double end)
+{
+     record(tr, 'X', tid, name, detail, arg, start, end-start);
+}
+
+
+/*
+ *
+ * psp_trace_instant(): something that happened at time t
+ *
+ */
+void psp_trace_instant(psp_trace* tr, int tid, const char* name, const char* detail,
+                       int arg, double t)
+{
+     record(tr, 'i', tid, name, detail, arg, t, 0);
+}
+
+
+/*
+ *
+ * psp_trace_save(): write what was recorded as Chrome trace-event JSON
+ *
+ */
+int psp_trace_save(psp_trace* tr, const char* filename)
+{
+static const char* rows[] = { NULL, "engine", "client", "lines" };
+psp_trace_event* e;
+unsigned long i, n;
+FILE* f;
+int tid;
+
+     f = fopen(filename, "w");
+     if (f == NULL)
+         return -1;
+
+     fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+     for (tid=PSP_TRACE_ENGINE; tid<=PSP_TRACE_LINES; tid++)
+         fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                 "\"args\":{\"name\":\"%s\"}}", (tid == PSP_TRACE_ENGINE)?"":",", tid, rows[tid]);
+
+     n = __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE);
+     if (n > tr->size)
+         n = tr->size;
+     for (i=0; i<n; i++)
+     {
+         e = &tr->events[i];
+         if (__atomic_load_n(&e->ph, __ATOMIC_ACQUIRE) == 0)
+             continue;               // Still being written
+         fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f",
+                 e->name, e->ph, e->tid, e->t*1000000.0);
+         if (e->ph == 'X')
+             fprintf(f, ",\"dur\":%.3f", e->dur*1000000.0);
+         else
+             fprintf(f, ",\"s\":\"t\"");
+         fprintf(f, ",\"args\":{");
+         if (e->detail)
+             fprintf(f, "\"detail\":\"%s\"%s", e->detail, (e->arg >= 0)?",":"");
+         if (e->arg >= 0)
+             fprintf(f, "\"arg\":\"0x%02X\"", e->arg);
+         fprintf(f, "}}");
+     }
+     fprintf(f, "\n],\"otherData\":{\"dropped\":%lu}}\n", tr->dropped);
+
+     return (fclose(f) == 0)?0:-1;
+}